@@ -0,0 +1,322 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+
+#include "cachemanager.h"
+#include "global.h"
+#include "tile.h"
+
+#define JOURNAL_FILE TILE_DIR "cache.journal"
+
+/**
+ * @brief number of tiles deleted at once before yielding the disk again
+ */
+#define EVICTION_BATCH (64)
+
+/**
+ * @brief the highest zoom level fitting into the 28 bits of a tile coordinate
+ */
+#define JOURNAL_MAX_ZOOM (28)
+
+/**
+ * @brief records claiming larger tiles are considered corrupt
+ */
+#define JOURNAL_MAX_TILE_SIZE (64ULL * 1024 * 1024)
+
+CacheManager* CacheManager::_instance = nullptr;
+
+/**
+ * @brief the sources whose tiles are kept within the quota, indexed by the top
+ * bits of a key. New sources have to be appended to keep existing journals valid.
+ */
+static s_tile_source* sources[] = { &map_source, &elevation_source, &vector_source };
+
+#define SOURCE_COUNT (sizeof(sources) / sizeof(sources[0]))
+
+static uint64_t tile_key(s_tile_source* source, int zoom, int x, int y) {
+    uint64_t index = std::find(sources, sources + SOURCE_COUNT, source) - sources;
+    return (index << 61) | ((uint64_t) zoom << 56) | ((uint64_t) x << 28) | (uint64_t) y;
+}
+
+static size_t key_source(uint64_t key) {
+    return (size_t) (key >> 61);
+}
+
+static int key_zoom(uint64_t key) {
+    return (int) ((key >> 56) & 0x1f);
+}
+
+static int key_x(uint64_t key) {
+    return (int) ((key >> 28) & 0xfffffff);
+}
+
+static int key_y(uint64_t key) {
+    return (int) (key & 0xfffffff);
+}
+
+static std::string key_filename(uint64_t key, const std::string& extension) {
+    std::stringstream filename;
+    filename << TILE_DIR << sources[key_source(key)]->name << key_zoom(key) << "/" << key_x(key) << '/' << key_y(key) << extension;
+    return filename.str();
+}
+
+CacheManager::CacheManager() {
+    thread = boost::thread(boost::bind(&CacheManager::run, this));
+}
+
+CacheManager::~CacheManager() {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        running = false;
+    }
+    condition.notify_one();
+    thread.join();
+    if (journal != nullptr) {
+        fclose(journal);
+    }
+}
+
+void CacheManager::touch(s_tile_source* source, int zoom, int x, int y) {
+    if (std::find(sources, sources + SOURCE_COUNT, source) == sources + SOURCE_COUNT) {
+        return;
+    }
+    boost::lock_guard<boost::mutex> lock(mutex);
+    pending.push_back(tile_key(source, zoom, x, y));
+}
+
+void CacheManager::set_view(int zoom, int left, int top, int right, int bottom) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    view.zoom = zoom;
+    view.left = left;
+    view.top = top;
+    view.right = right;
+    view.bottom = bottom;
+}
+
+void CacheManager::run() {
+    // Evicting is housekeeping, don't compete with the loader threads
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    read_journal();
+
+    std::vector<uint64_t> accesses;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condition.timed_wait(lock, boost::posix_time::seconds(1));
+            if (!running) {
+                break;
+            }
+            accesses.swap(pending);
+        }
+
+        for (uint64_t key : accesses) {
+            record(key);
+        }
+        accesses.clear();
+
+        // Delete in small batches and pause between them
+        while (evict(EVICTION_BATCH)) {
+            fflush(journal);
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (!running) {
+                break;
+            }
+        }
+
+        if (journal_records > 2 * entries.size() + 1024) {
+            compact_journal();
+        }
+        fflush(journal);
+    }
+}
+
+void CacheManager::read_journal() {
+    FILE* fp = fopen(JOURNAL_FILE, "rb");
+    if (fp != nullptr) {
+        s_journal_entry entry;
+        off_t complete = 0;
+        while (fread(&entry, sizeof(entry), 1, fp) == 1) {
+            int zoom = key_zoom(entry.key);
+            if (key_source(entry.key) >= SOURCE_COUNT || zoom > JOURNAL_MAX_ZOOM || key_x(entry.key) >= (1 << zoom) || key_y(entry.key) >= (1 << zoom)
+                    || entry.size > JOURNAL_MAX_TILE_SIZE) {
+                std::cerr << "Cache journal is corrupt after " << journal_records << " records, dropping the rest" << std::endl;
+                break;
+            }
+            update(entry.key, entry.seq, entry.size);
+            seq = std::max(seq, entry.seq);
+            journal_records++;
+            complete += sizeof(entry);
+        }
+        fclose(fp);
+        // Cut off a torn or corrupt tail (e.g. after a power loss), otherwise
+        // every record appended from now on would be misaligned
+        if (truncate(JOURNAL_FILE, complete) != 0) {
+            std::cerr << "Failed to truncate cache journal " << JOURNAL_FILE << std::endl;
+        }
+    }
+    std::cout << "Tile cache contains " << entries.size() << " tiles (" << (total_size / 1024) << " kB)" << std::endl;
+
+    journal = fopen(JOURNAL_FILE, "ab");
+    if (journal == nullptr) {
+        std::cerr << "Failed to open cache journal " << JOURNAL_FILE << std::endl;
+    }
+}
+
+void CacheManager::compact_journal() {
+    std::string tmp = JOURNAL_FILE ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (fp == nullptr) {
+        return;
+    }
+    for (std::pair<uint64_t, uint64_t> entry : recency) {
+        s_journal_entry record = { entry.second, entry.first, entries[entry.second].size };
+        fwrite(&record, sizeof(record), 1, fp);
+    }
+    fclose(fp);
+    if (rename(tmp.c_str(), JOURNAL_FILE) != 0) {
+        return;
+    }
+    if (journal != nullptr) {
+        fclose(journal);
+    }
+    journal = fopen(JOURNAL_FILE, "ab");
+    journal_records = entries.size();
+}
+
+void CacheManager::append_journal(uint64_t key, uint64_t size) {
+    if (journal == nullptr) {
+        return;
+    }
+    s_journal_entry entry = { key, seq, size };
+    fwrite(&entry, sizeof(entry), 1, journal);
+    journal_records++;
+}
+
+void CacheManager::record(uint64_t key) {
+    boost::system::error_code ec;
+    uint64_t size = 0;
+    uint64_t file = boost::filesystem::file_size(key_filename(key, sources[key_source(key)]->extension), ec);
+    if (!ec) {
+        size += file;
+    }
+    uint64_t tex = boost::filesystem::file_size(key_filename(key, ".tex"), ec);
+    if (!ec) {
+        size += tex;
+    }
+    if (size == 0) {
+        return;
+    }
+    seq++;
+    update(key, seq, size);
+    append_journal(key, size);
+}
+
+void CacheManager::update(uint64_t key, uint64_t seq, uint64_t size) {
+    std::unordered_map<uint64_t, s_entry>::iterator entry = entries.find(key);
+    if (entry != entries.end()) {
+        total_size -= entry->second.size;
+        recency.erase(entry->second.seq);
+        if (size == 0) {
+            entries.erase(entry);
+            return;
+        }
+        entry->second.seq = seq;
+        entry->second.size = size;
+    } else if (size == 0) {
+        return;
+    } else {
+        entries[key] = { seq, size };
+    }
+    total_size += size;
+    recency[seq] = key;
+}
+
+bool CacheManager::evict(size_t batch) {
+    std::vector<uint64_t> victims;
+    uint64_t size = total_size;
+    size_t count = entries.size();
+    for (std::pair<uint64_t, uint64_t> entry : recency) {
+        bool over_size = cache_config.max_bytes != 0 && size > cache_config.max_bytes;
+        bool over_count = cache_config.max_tiles != 0 && count > cache_config.max_tiles;
+        if ((!over_size && !over_count) || victims.size() >= batch) {
+            break;
+        }
+        if (is_pinned(entry.second)) {
+            continue;
+        }
+        victims.push_back(entry.second);
+        size -= entries[entry.second].size;
+        count--;
+    }
+
+    for (uint64_t key : victims) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(key_filename(key, sources[key_source(key)]->extension), ec);
+        boost::filesystem::remove(key_filename(key, ".tex"), ec);
+        update(key, 0, 0);
+        append_journal(key, 0);
+    }
+    return victims.size() >= batch;
+}
+
+bool CacheManager::is_pinned(uint64_t key) {
+    int zoom = key_zoom(key);
+    int x = key_x(key);
+    int y = key_y(key);
+
+    {
+        // Sources without the zoom level of the view are drawn from their covering tiles
+        boost::lock_guard<boost::mutex> lock(mutex);
+        int shift = view.zoom - std::min(view.zoom, sources[key_source(key)]->max_zoom);
+        if (view.zoom - shift == zoom && x >= (view.left >> shift) && x <= (view.right >> shift) &&
+                y >= (view.top >> shift) && y <= (view.bottom >> shift)) {
+            return true;
+        }
+    }
+
+    if (std::find(cache_config.pinned_zooms.begin(), cache_config.pinned_zooms.end(), zoom) != cache_config.pinned_zooms.end()) {
+        return true;
+    }
+
+    for (s_cache_region& region : cache_config.pinned_regions) {
+        if (zoom < region.min_zoom || zoom > region.max_zoom) {
+            continue;
+        }
+        if (x >= long2tilex(region.west, zoom) && x <= long2tilex(region.east, zoom) &&
+                y >= lat2tiley(region.north, zoom) && y <= lat2tiley(region.south, zoom)) {
+            return true;
+        }
+    }
+    return false;
+}
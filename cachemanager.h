@@ -0,0 +1,132 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_CACHEMANAGER_H_
+#define _SM3D_CACHEMANAGER_H_
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "tile.h"
+
+/**
+ * @brief keeps the tile directory within the configured quota
+ *
+ * Accesses are recorded in a journal in the tile directory instead of relying
+ * on the file access times. On startup only the journal is read, the tile
+ * directory is never walked. Tiles which were never recorded (e.g. from older
+ * versions) are not known to the manager and thereby never evicted.
+ */
+class CacheManager {
+public:
+    static CacheManager* instance() {
+        static CGuard g;
+        if (!_instance) {
+            _instance = new CacheManager();
+        }
+        return _instance;
+    }
+
+    /**
+     * @brief record an access to the files of a tile, may be called from any thread
+     */
+    void touch(s_tile_source* source, int zoom, int x, int y);
+    /**
+     * @brief set the currently visible tiles, which are never evicted
+     *
+     * For sources ending below the zoom level, e.g. the elevation tiles, the
+     * tiles covering the view at their highest zoom level are kept instead.
+     */
+    void set_view(int zoom, int left, int top, int right, int bottom);
+private:
+    static CacheManager* _instance;
+    CacheManager();
+    CacheManager(const CacheManager&) {}
+    ~CacheManager();
+
+    /**
+     * @brief a single record of the journal
+     */
+    struct s_journal_entry {
+        uint64_t key;
+        uint64_t seq;
+        /**
+         * @brief size of the tile files in bytes, 0 if the tile was evicted
+         */
+        uint64_t size;
+    };
+
+    struct s_entry {
+        uint64_t seq;
+        uint64_t size;
+    };
+
+    struct s_view {
+        int zoom = -1;
+        int left;
+        int top;
+        int right;
+        int bottom;
+    };
+
+    boost::thread thread;
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    bool running = true;
+    std::vector<uint64_t> pending;
+    s_view view;
+
+    // Only accessed from the manager thread
+    FILE* journal = nullptr;
+    uint64_t journal_records = 0;
+    uint64_t seq = 0;
+    uint64_t total_size = 0;
+    std::unordered_map<uint64_t, s_entry> entries;
+    std::map<uint64_t, uint64_t> recency;
+
+    void run();
+    void read_journal();
+    void compact_journal();
+    void append_journal(uint64_t key, uint64_t size);
+    void record(uint64_t key);
+    void update(uint64_t key, uint64_t seq, uint64_t size);
+    bool evict(size_t batch);
+    bool is_pinned(uint64_t key);
+
+    class CGuard {
+    public:
+        ~CGuard() {
+            if (CacheManager::_instance != nullptr) {
+                delete CacheManager::_instance;
+                CacheManager::_instance = nullptr;
+            }
+        }
+    };
+    friend class CGuard;
+};
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+#include <SDL2/SDL_image.h>
+#include <boost/thread.hpp>
+
+#include "export.h"
+#include "global.h"
+#include "loader.h"
+#include "texcache.h"
+#include "tile.h"
+
+/**
+ * @brief a decoded map tile as tightly packed RGB, empty if it is not available
+ */
+struct s_export_tile {
+    boost::mutex mutex;
+    bool loaded = false;
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> pixels;
+};
+
+typedef std::shared_ptr<s_export_tile> export_tile_t;
+
+/**
+ * @brief the decoded tiles shared by all jobs, the most recently used first
+ */
+static boost::mutex cache_mutex;
+static std::list<uint64_t> cache_order;
+static std::unordered_map<uint64_t, std::pair<export_tile_t, std::list<uint64_t>::iterator>> cache;
+
+static uint64_t tile_key(int zoom, int x, int y) {
+    return ((uint64_t) zoom << 56) | ((uint64_t) x << 28) | (uint64_t) y;
+}
+
+static long now_ms() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+}
+
+/**
+ * @brief decode a tile, preferring its transcoded copy and downloading it if necessary
+ */
+static void decode_tile(s_export_tile& target, int zoom, int x, int y) {
+    Tile tile(zoom, x, y, 0);
+
+    if (cache_config.transcode) {
+        MappedTexture cached(TILE_DIR + tile.get_cache_filename());
+        if (cached.valid()) {
+            const s_texcache_header* header = cached.get_header();
+            const unsigned char* source = (const unsigned char*) cached.get_pixels();
+            bool swap = header->format == GL_BGR || header->format == GL_BGRA;
+            size_t count = (size_t) header->width * header->height;
+            target.width = header->width;
+            target.height = header->height;
+            target.pixels.resize(count * 3);
+            for (size_t i = 0; i < count; i++, source += header->bytes_per_pixel) {
+                target.pixels[i * 3 + 0] = source[swap ? 2 : 0];
+                target.pixels[i * 3 + 1] = source[1];
+                target.pixels[i * 3 + 2] = source[swap ? 0 : 2];
+            }
+            return;
+        }
+    }
+
+    if (!Loader::instance()->fetch_image(tile)) {
+        std::cerr << "Tile " << tile.get_filename() << " is not available" << std::endl;
+        return;
+    }
+    SDL_Surface* surface = IMG_Load((TILE_DIR + tile.get_filename()).c_str());
+    if (surface == nullptr) {
+        std::cerr << "Failed to decode " << tile.get_filename() << ": " << IMG_GetError() << std::endl;
+        return;
+    }
+    SDL_Surface* rgb = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGB24, 0);
+    SDL_FreeSurface(surface);
+    if (rgb == nullptr) {
+        return;
+    }
+    if (SDL_MUSTLOCK(rgb)) {
+        SDL_LockSurface(rgb);
+    }
+    size_t row = (size_t) rgb->w * 3;
+    target.width = rgb->w;
+    target.height = rgb->h;
+    target.pixels.resize(row * rgb->h);
+    for (int i = 0; i < rgb->h; i++) {
+        std::copy_n((const unsigned char*) rgb->pixels + i * rgb->pitch, row, target.pixels.begin() + i * row);
+    }
+    if (SDL_MUSTLOCK(rgb)) {
+        SDL_UnlockSurface(rgb);
+    }
+    SDL_FreeSurface(rgb);
+}
+
+/**
+ * @brief get a decoded tile from the shared cache, decoding it at most once
+ */
+static export_tile_t get_tile(int zoom, int x, int y) {
+    uint64_t key = tile_key(zoom, x, y);
+    export_tile_t tile;
+    {
+        boost::lock_guard<boost::mutex> lock(cache_mutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            cache_order.splice(cache_order.begin(), cache_order, it->second.second);
+            tile = it->second.first;
+        } else {
+            tile = std::make_shared<s_export_tile>();
+            cache_order.push_front(key);
+            cache[key] = std::make_pair(tile, cache_order.begin());
+            // Jobs still using an evicted tile keep their reference
+            while (cache.size() > EXPORT_CACHE) {
+                cache.erase(cache_order.back());
+                cache_order.pop_back();
+            }
+        }
+    }
+
+    // Other jobs needing the same tile wait here instead of decoding it again
+    boost::lock_guard<boost::mutex> lock(tile->mutex);
+    if (!tile->loaded) {
+        decode_tile(*tile, zoom, x, y);
+        tile->loaded = true;
+    }
+    return tile;
+}
+
+/**
+ * @brief composite the tiles of a job into an RGB image
+ *
+ * This inverts the transformation of render(): the screen is untilted and
+ * rotated back onto the map plane, where the tiles are 2 * TILE_SIZE wide and
+ * offset from the center of the screen the same way.
+ */
+static void render_job(const s_export_job& job, std::vector<unsigned char>& image) {
+    int zoom = job.zoom;
+    int tiles = 1 << zoom;
+    int center_x = long2tilex(job.longitude, zoom);
+    int center_y = lat2tiley(job.latitude, zoom);
+
+    // Top left coordinate of the center tile and its offset from the center of the screen
+    double tile_latitude = tiley2lat(center_y, zoom);
+    double tile_longitude = tilex2long(center_x, zoom);
+    double lat_diff = (TILE_SIZE/2) + ((job.latitude - tile_latitude) * TILE_SIZE / latsize(job.latitude, zoom));
+    double lon_diff = (TILE_SIZE/2) + ((tile_longitude - job.longitude) * TILE_SIZE / lonsize(zoom));
+
+    double _cos = std::cos(job.angle_rotate * M_PI / 180);
+    double _sin = std::sin(job.angle_rotate * M_PI / 180);
+    double tilt = std::cos(job.angle_tilt * M_PI / 180);
+
+    // Map plane position in tiles of a screen position, as origin plus steps per column and row
+    double scale = 1.0 / (2 * TILE_SIZE);
+    double origin_x = center_x + (TILE_SIZE - lon_diff) * scale;
+    double origin_y = center_y + (TILE_SIZE - lat_diff) * scale;
+    double column_x = _cos * scale;
+    double column_y = _sin * scale;
+    double row_x = -_sin / tilt * scale;
+    double row_y = _cos / tilt * scale;
+
+    // Tiles used by this job, so the shared cache is only locked once per tile
+    std::unordered_map<uint64_t, export_tile_t> used;
+    uint64_t current_key = ~0ULL;
+    s_export_tile* current = nullptr;
+
+    image.assign((size_t) job.width * job.height * 3, 0);
+    unsigned char* out = image.data();
+    for (int row = 0; row < job.height; row++) {
+        double screen_y = row + 0.5 - job.height / 2.0;
+        double screen_x = 0.5 - job.width / 2.0;
+        double map_x = origin_x + screen_x * column_x + screen_y * row_x;
+        double map_y = origin_y + screen_x * column_y + screen_y * row_y;
+        for (int column = 0; column < job.width; column++, out += 3, map_x += column_x, map_y += column_y) {
+            int tile_y = (int) std::floor(map_y);
+            if (tile_y < 0 || tile_y >= tiles) {
+                continue;
+            }
+            int tile_x = (int) std::floor(map_x);
+            int wrapped_x = ((tile_x % tiles) + tiles) % tiles;
+
+            uint64_t key = tile_key(zoom, wrapped_x, tile_y);
+            if (key != current_key) {
+                export_tile_t& tile = used[key];
+                if (!tile) {
+                    tile = get_tile(zoom, wrapped_x, tile_y);
+                }
+                current = tile.get();
+                current_key = key;
+            }
+            if (current->pixels.empty()) {
+                continue;
+            }
+
+            // Bilinear filtering within the tile, like GL_LINEAR
+            double u = (map_x - tile_x) * current->width - 0.5;
+            double v = (map_y - tile_y) * current->height - 0.5;
+            int u0 = std::max(0, std::min(current->width - 1, (int) std::floor(u)));
+            int v0 = std::max(0, std::min(current->height - 1, (int) std::floor(v)));
+            int u1 = std::min(current->width - 1, u0 + 1);
+            int v1 = std::min(current->height - 1, v0 + 1);
+            double fu = std::max(0.0, std::min(1.0, u - u0));
+            double fv = std::max(0.0, std::min(1.0, v - v0));
+            const unsigned char* p00 = &current->pixels[((size_t) v0 * current->width + u0) * 3];
+            const unsigned char* p01 = &current->pixels[((size_t) v0 * current->width + u1) * 3];
+            const unsigned char* p10 = &current->pixels[((size_t) v1 * current->width + u0) * 3];
+            const unsigned char* p11 = &current->pixels[((size_t) v1 * current->width + u1) * 3];
+            for (int c = 0; c < 3; c++) {
+                double top = p00[c] + (p01[c] - p00[c]) * fu;
+                double bottom = p10[c] + (p11[c] - p10[c]) * fu;
+                out[c] = (unsigned char) (top + (bottom - top) * fv + 0.5);
+            }
+        }
+    }
+}
+
+static bool ends_with(const std::string& value, const std::string& suffix) {
+    if (value.size() < suffix.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < suffix.size(); i++) {
+        if (std::tolower(value[value.size() - suffix.size() + i]) != suffix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief encode an RGB image as PNG or JPEG, depending on the file name
+ */
+static bool write_image(const s_export_job& job, std::vector<unsigned char>& image) {
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom(image.data(), job.width, job.height, 24, job.width * 3, SDL_PIXELFORMAT_RGB24);
+    if (surface == nullptr) {
+        return false;
+    }
+    int result;
+    if (ends_with(job.output, ".jpg") || ends_with(job.output, ".jpeg")) {
+        result = IMG_SaveJPG(surface, job.output.c_str(), EXPORT_JPEG_QUALITY);
+    } else {
+        result = IMG_SavePNG(surface, job.output.c_str());
+    }
+    SDL_FreeSurface(surface);
+    return result == 0;
+}
+
+/**
+ * @brief take jobs until none are left, rendering and encoding each on this thread
+ */
+static void export_worker(const std::vector<s_export_job>* jobs, std::atomic<size_t>* next, std::atomic<size_t>* failed) {
+    std::vector<unsigned char> image;
+    for (size_t i = (*next)++; i < jobs->size(); i = (*next)++) {
+        const s_export_job& job = (*jobs)[i];
+        render_job(job, image);
+        if (!write_image(job, image)) {
+            std::cerr << "Failed to write " << job.output << ": " << IMG_GetError() << std::endl;
+            (*failed)++;
+        }
+    }
+}
+
+/**
+ * @brief read the jobs of a batch file
+ * @return false, if the file could not be read
+ */
+static bool read_batch(const std::string& filename, std::vector<s_export_job>& jobs) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Could not open batch file " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        s_export_job job;
+        if (!(fields >> job.latitude >> job.longitude >> job.zoom >> job.angle_rotate >> job.angle_tilt >> job.width >> job.height >> job.output)
+                || job.zoom < 0 || job.zoom > map_source.max_zoom || job.width <= 0 || job.height <= 0
+                || std::abs(job.angle_tilt) >= 90) {
+            std::cerr << filename << ":" << number << ": invalid job, skipping it" << std::endl;
+            continue;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+int export_batch(const std::string& filename) {
+    std::vector<s_export_job> jobs;
+    if (!read_batch(filename, jobs)) {
+        return 1;
+    }
+
+    IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
+    // The singletons are not thread safe to create, do it before the workers fetch tiles
+    Loader::instance();
+    long start_time = now_ms();
+
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+    unsigned int threads = std::max(1u, boost::thread::hardware_concurrency());
+    boost::thread_group workers;
+    for (unsigned int i = 0; i < threads; i++) {
+        workers.create_thread(boost::bind(&export_worker, &jobs, &next, &failed));
+    }
+    workers.join_all();
+
+    long duration = std::max(1L, now_ms() - start_time);
+    std::cout << "Exported " << jobs.size() - failed << " images in " << duration << " ms ("
+              << (jobs.size() - failed) * 1000.0 / duration << " images per second, " << threads << " threads)" << std::endl;
+    IMG_Quit();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_EXPORT_H_
+#define _SM3D_EXPORT_H_
+
+#include <string>
+
+/**
+ * @brief the number of decoded tiles kept in memory while exporting
+ */
+#define EXPORT_CACHE (1024)
+
+/**
+ * @brief quality of exported JPEG images
+ */
+#define EXPORT_JPEG_QUALITY (90)
+
+/**
+ * @brief a static map image to export
+ */
+struct s_export_job {
+    double latitude;
+    double longitude;
+    int zoom;
+    double angle_rotate;
+    double angle_tilt;
+    int width;
+    int height;
+    /**
+     * @brief the image file, written as JPEG if it ends with ".jpg" or ".jpeg" and as PNG otherwise
+     */
+    std::string output;
+};
+
+/**
+ * @brief render the static map images listed in a batch file without opening a window
+ *
+ * Every line of the batch file holds one job as "latitude longitude zoom rotate
+ * tilt width height output", empty lines and lines starting with '#' are
+ * skipped. The map tiles are composited on the CPU with the same projection as
+ * render(), the jobs are spread over all cores and tiles shared between jobs
+ * are decoded once. Missing tiles are downloaded into the tile directory.
+ *
+ * @return the exit code of the program
+ */
+extern int export_batch(const std::string& filename);
+
+#endif
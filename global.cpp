@@ -26,3 +26,4 @@
 
 struct s_window_state window_state;
 struct s_player_state player_state;
+struct s_cache_config cache_config;
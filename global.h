@@ -25,6 +25,8 @@
 #ifndef _SM3D_GLOBAL_H_
 #define _SM3D_GLOBAL_H_
 
+#include <vector>
+
 #define TILE_DIR "./"
 
 /**
@@ -55,7 +57,55 @@ struct s_player_state {
     int zoom = 16;
 };
 
+/**
+ * @brief a region whose tiles are never evicted from the tile directory
+ */
+struct s_cache_region {
+    double north;
+    double west;
+    double south;
+    double east;
+    int min_zoom;
+    int max_zoom;
+};
+
+/**
+ * @brief holds the configuration of the on-disk tile caches
+ */
+struct s_cache_config {
+    /**
+     * @brief keep a copy of every tile in its final texture format next to
+     * the PNG, so warm starts can upload it without decoding
+     *
+     * The copies take about ten times the space of the PNGs, so they are
+     * only written when enabled with --transcode.
+     */
+    bool transcode = false;
+    /**
+     * @brief maximum size of the tile directory in bytes, 0 for unlimited
+     */
+    unsigned long long max_bytes = 512ULL * 1024 * 1024;
+    /**
+     * @brief maximum number of tiles in the tile directory, 0 for unlimited
+     */
+    unsigned long max_tiles = 100000;
+    /**
+     * @brief zoom levels which are never evicted
+     */
+    std::vector<int> pinned_zooms;
+    /**
+     * @brief regions which are never evicted
+     */
+    std::vector<s_cache_region> pinned_regions;
+    /**
+     * @brief share decoded tiles and downloads with other viewer processes
+     * on this host through POSIX shared memory
+     */
+    bool shared = false;
+};
+
 extern struct s_window_state window_state;
 extern struct s_player_state player_state;
+extern struct s_cache_config cache_config;
 
 #endif
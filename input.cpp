@@ -58,8 +58,8 @@ void handle_mouse_motion(SDL_MouseMotionEvent &motion) {
         long double _sin = std::sin(viewport_state.angle_rotate * M_PI / 180);
         player_state.latitude += (latsize(player_state.latitude, player_state.zoom)/TILE_SIZE) * (motion.yrel * _cos + motion.xrel * _sin) / std::cos(viewport_state.angle_tilt * M_PI / 180);
         // Cap between a latitude of -66° ad 80° due to the limitations of mercator
-        player_state.latitude = std::min(player_state.latitude, 80.0);
-        player_state.latitude = std::max(player_state.latitude, -66.0);
+        player_state.latitude = std::min(player_state.latitude, MAX_LATITUDE);
+        player_state.latitude = std::max(player_state.latitude, MIN_LATITUDE);
         player_state.longitude -= (lonsize(player_state.zoom)/TILE_SIZE) * (motion.xrel * _cos - motion.yrel * _sin);
     }
 }
@@ -88,6 +88,6 @@ void handle_mouse_button_up(SDL_MouseButtonEvent &button) {
 
 void handle_mouse_wheel(SDL_MouseWheelEvent &wheel) {
     player_state.zoom += wheel.y;
-    player_state.zoom = std::max(player_state.zoom, 1);
-    player_state.zoom = std::min(player_state.zoom, 18);
+    player_state.zoom = std::max(player_state.zoom, MIN_ZOOM);
+    player_state.zoom = std::min(player_state.zoom, MAX_ZOOM);
 }
@@ -31,6 +31,18 @@
 
 #define MAX_TILT (65)
 
+/**
+ * @brief the zoom levels the user can zoom to
+ */
+#define MIN_ZOOM (1)
+#define MAX_ZOOM (18)
+
+/**
+ * @brief the latitudes the user can move to, due to the limitations of mercator
+ */
+#define MIN_LATITUDE (-66.0)
+#define MAX_LATITUDE (80.0)
+
 struct s_viewport_state {
     double angle_rotate = 0.0;
     double angle_tilt = 0.0;
@@ -23,6 +23,12 @@
  */
 
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_set>
+#include <vector>
+#include <sys/resource.h>
 #include <boost/filesystem.hpp>
 #include <SDL2/SDL_image.h>
 #include <curl/curl.h>
@@ -31,11 +37,64 @@
 
 #include "loader.h"
 #include "global.h"
+#include "texcache.h"
+#include "cachemanager.h"
+#include "shmcache.h"
+
+/**
+ * @brief how long to wait for another process downloading a tile in milliseconds
+ */
+#define SHARED_WAIT_TIMEOUT (30000)
 
 boost::thread_group pool;
 boost::asio::io_service ioService;
 boost::asio::io_service::work * work;
 
+/**
+ * @brief a tile decoded by a loader thread, waiting for its texture upload
+ */
+struct s_decoded_image {
+    Tile* tile;
+    SDL_Surface* texture;
+    GLenum texture_format;
+    MappedTexture* cached;
+    s_shm_image shared;
+};
+
+boost::mutex decoded_mutex;
+std::vector<s_decoded_image> decoded;
+std::atomic<size_t> decoding(0);
+
+/**
+ * @brief the downloads posted to the loader threads and not finished yet
+ */
+std::atomic<size_t> downloads_pending(0);
+
+/**
+ * @brief counters of the downloads, reported every LOADER_STATISTICS_INTERVAL downloads
+ */
+struct s_loader_statistics {
+    unsigned long downloads = 0;
+    unsigned long failures = 0;
+    unsigned long duplicates = 0;
+    unsigned long long bytes = 0;
+    size_t in_flight = 0;
+    size_t max_in_flight = 0;
+    /**
+     * @brief the latencies of the downloads since the last report in microseconds
+     */
+    std::vector<long> latencies;
+    std::chrono::steady_clock::time_point interval_start = std::chrono::steady_clock::now();
+};
+
+/**
+ * @brief the tiles currently downloaded, guarded by downloads_mutex like the statistics
+ */
+boost::mutex downloads_mutex;
+boost::condition_variable downloads_done;
+std::unordered_set<std::string> downloading;
+s_loader_statistics statistics;
+
 Loader* Loader::_instance = nullptr;
 
 size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
@@ -44,7 +103,132 @@ size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     return written;
 }
 
+/**
+ * @brief determine the OpenGL pixel format of a surface
+ *
+ * Surfaces OpenGL cannot consume directly are converted to BGR first, in this
+ * case the passed surface is freed and replaced.
+ */
+static GLenum surface_format(SDL_Surface*& texture) {
+    if (texture->format->BytesPerPixel == 4) {
+        if (texture->format->Rmask == 0x000000ff) {
+            return GL_RGBA;
+        } else {
+            return GL_BGRA;
+        }
+    } else if (texture->format->BytesPerPixel == 3) {
+        if (texture->format->Rmask == 0x000000ff) {
+            return GL_RGB;
+        } else {
+            return GL_BGR;
+        }
+    }
+    std::cout << "INVALID (" << SDL_GetPixelFormatName(texture->format->format);
+    SDL_PixelFormat* format = SDL_AllocFormat(SDL_PIXELFORMAT_BGR24);
+    SDL_Surface* tmp = SDL_ConvertSurface(texture, format, 0);
+    SDL_FreeFormat(format);
+    SDL_FreeSurface(texture);
+    texture = tmp;
+    std::cout << " -> " << SDL_GetPixelFormatName(texture->format->format) << ") ";
+    return GL_BGR;
+}
+
+/**
+ * @brief upload a surface into a new texture
+ */
+static GLuint upload_surface(SDL_Surface* texture, GLenum texture_format) {
+    if (SDL_MUSTLOCK(texture)) {
+        SDL_LockSurface(texture);
+    }
+
+    GLuint texid;
+    glGenTextures(1, &texid);
+    glBindTexture(GL_TEXTURE_2D, texid);
+
+    glTexImage2D(GL_TEXTURE_2D, 0, 3, texture->w, texture->h, 0, texture_format, GL_UNSIGNED_BYTE, texture->pixels);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    if (SDL_MUSTLOCK(texture)) {
+        SDL_UnlockSurface(texture);
+    }
+    return texid;
+}
+
+/**
+ * @brief upload tightly packed pixels into a new texture
+ */
+static GLuint upload_pixels(const s_shm_image& image) {
+    GLuint texid;
+    glGenTextures(1, &texid);
+    glBindTexture(GL_TEXTURE_2D, texid);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, 3, image.width, image.height, 0, image.format, GL_UNSIGNED_BYTE, image.pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    return texid;
+}
+
+/**
+ * @brief whether a tile goes through the cache shared with other processes
+ */
+static bool shared_tile(Tile* tile) {
+    return cache_config.shared && tile->source == &map_source && ShmCache::instance()->valid();
+}
+
+/**
+ * @brief copy a decoded surface into a claimed slot of the shared cache
+ */
+static void publish_surface(int slot, SDL_Surface* texture, GLenum texture_format) {
+    if (SDL_MUSTLOCK(texture)) {
+        SDL_LockSurface(texture);
+    }
+    ShmCache::instance()->publish(slot, texture, texture_format);
+    if (SDL_MUSTLOCK(texture)) {
+        SDL_UnlockSurface(texture);
+    }
+}
+
+/**
+ * @brief offer a tile decoded by this process to the other processes
+ */
+static void share_surface(Tile* tile, SDL_Surface* texture, GLenum texture_format) {
+    int slot;
+    if (shared_tile(tile) && ShmCache::instance()->claim(tile->zoom, tile->x, tile->y, slot) == SHM_CLAIMED) {
+        publish_surface(slot, texture, texture_format);
+    }
+}
+
+/**
+ * @brief print the download statistics, called with downloads_mutex held
+ */
+static void report_statistics() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(now - statistics.interval_start).count() / 1000.0;
+    std::vector<long>& latencies = statistics.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::cout << "Loader: " << statistics.downloads << " downloads (" << statistics.failures << " failed, "
+              << statistics.duplicates << " duplicate requests), " << (statistics.bytes / 1024) << " kB, "
+              << (latencies.size() / std::max(seconds, 0.001)) << " tiles/s, latency p50 "
+              << latencies[latencies.size() / 2] / 1000.0 << " ms p99 "
+              << latencies[latencies.size() * 99 / 100] / 1000.0 << " ms max " << latencies.back() / 1000.0
+              << " ms, " << statistics.max_in_flight << " in flight at most, max RSS " << (usage.ru_maxrss / 1024) << " MB" << std::endl;
+
+    latencies.clear();
+    statistics.interval_start = now;
+}
+
 Loader::Loader() {
+    // curl_easy_init() would do this lazily, which is not thread safe
+    curl_global_init(CURL_GLOBAL_DEFAULT);
     work = new boost::asio::io_service::work(ioService);
     for (int i = 0; i < 5; i++) {
         pool.create_thread(boost::bind(&boost::asio::io_service::run, &ioService));
@@ -55,107 +239,236 @@ Loader::~Loader() {
     ioService.stop();
     pool.join_all();
     delete work;
+    curl_global_cleanup();
 }
 
 void Loader::download_image(Tile* tile) {
+    std::string file = TILE_DIR + tile->get_filename();
+    {
+        boost::unique_lock<boost::mutex> lock(downloads_mutex);
+        // A tile requested again while it is downloaded waits for the running download
+        if (downloading.count(file) > 0) {
+            statistics.duplicates++;
+            while (downloading.count(file) > 0) {
+                downloads_done.wait(lock);
+            }
+            if (boost::filesystem::exists(file)) {
+                tile->texid = 0;
+            }
+            downloads_pending--;
+            return;
+        }
+        downloading.insert(file);
+        statistics.max_in_flight = std::max(statistics.max_in_flight, ++statistics.in_flight);
+    }
+
+    download_file(tile);
+
+    boost::lock_guard<boost::mutex> lock(downloads_mutex);
+    downloading.erase(file);
+    statistics.in_flight--;
+    downloads_done.notify_all();
+    downloads_pending--;
+}
+
+void Loader::download_file(Tile* tile) {
+
+    // Only one process downloads a tile, the others pick it up when it is done
+    int slot = -1;
+    if (shared_tile(tile)) {
+        int state = ShmCache::instance()->claim(tile->zoom, tile->x, tile->y, slot);
+        if (state == SHM_READY || state == SHM_BUSY) {
+            ShmCache::instance()->wait(tile->zoom, tile->x, tile->y, SHARED_WAIT_TIMEOUT);
+            tile->texid = 0;
+            return;
+        }
+    }
 
     CURL* curl = curl_easy_init();
     if (curl == nullptr) {
         std::cerr << "Failed to initialize curl" << std::endl;
+        if (slot >= 0) {
+            ShmCache::instance()->abandon(slot);
+        }
         return;
     }
 
     std::stringstream dirname;
-    dirname << TILE_DIR << tile->zoom << "/" << tile->x;
+    dirname << TILE_DIR << tile->source->name << tile->zoom << "/" << tile->x;
     std::string dir = dirname.str();
-    boost::filesystem::create_directories(dir);
+    // Other loader threads may create the same directory at the same time
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(dir, ec);
     std::string filename = tile->get_filename();
-    std::string url = "http://localhost/osm_tiles/" + filename;
+    std::string url = tile->get_url();
     std::string file = TILE_DIR + filename;
-    FILE* fp = fopen(file.c_str(), "wb");
+    // Other processes may open the tile at any time, so it is only moved into
+    // place once it is complete
+    std::string part = file + ".part";
+    // The transcoded copy of an older version of the tile is stale now
+    boost::filesystem::remove(TILE_DIR + tile->get_cache_filename(), ec);
+    FILE* fp = fopen(part.c_str(), "wb");
+    if (fp == nullptr) {
+        std::cerr << "Failed to create " << part << std::endl;
+        curl_easy_cleanup(curl);
+        if (slot >= 0) {
+            ShmCache::instance()->abandon(slot);
+        }
+        return;
+    }
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+    // Vector tiles are usually served compressed, store them decompressed
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    // Do not store error pages as tiles
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    // Signals cannot be used for timeouts with several threads
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     CURLcode res = curl_easy_perform(curl);
+    long micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    long bytes = ftell(fp);
     fclose(fp);
     curl_easy_cleanup(curl);
+
+    {
+        boost::lock_guard<boost::mutex> lock(downloads_mutex);
+        statistics.downloads++;
+        statistics.bytes += std::max(bytes, 0L);
+        statistics.latencies.push_back(micros);
+        if (res != CURLE_OK) {
+            statistics.failures++;
+        }
+        if (statistics.downloads % LOADER_STATISTICS_INTERVAL == 0) {
+            report_statistics();
+        }
+    }
+
     if (res != CURLE_OK) {
-        std::cerr << "Failed to download: " << url << " " << res << std::endl;
+        std::cerr << "Failed to download: " << url << " " << curl_easy_strerror(res) << std::endl;
+        boost::filesystem::remove(part, ec);
+        if (slot >= 0) {
+            ShmCache::instance()->abandon(slot);
+        }
+        return;
+    }
+    boost::filesystem::rename(part, file, ec);
+    if (ec) {
+        std::cerr << "Failed to store " << file << ": " << ec.message() << std::endl;
+        if (slot >= 0) {
+            ShmCache::instance()->abandon(slot);
+        }
+        return;
+    }
+
+    // Decode the fresh tile here instead of on the render thread
+    if (tile->source->texture) {
+        SDL_Surface *texture = cache_config.transcode || slot >= 0 ? IMG_Load(file.c_str()) : nullptr;
+        if (texture) {
+            GLenum texture_format = surface_format(texture);
+            if (slot >= 0) {
+                publish_surface(slot, texture, texture_format);
+                slot = -1;
+            }
+            if (cache_config.transcode) {
+                transcode_image(tile, texture, texture_format);
+            } else {
+                SDL_FreeSurface(texture);
+                CacheManager::instance()->touch(tile->source, tile->zoom, tile->x, tile->y);
+            }
+        } else {
+            CacheManager::instance()->touch(tile->source, tile->zoom, tile->x, tile->y);
+        }
     } else {
-        tile->texid = 0;
+        CacheManager::instance()->touch(tile->source, tile->zoom, tile->x, tile->y);
     }
+    if (slot >= 0) {
+        ShmCache::instance()->abandon(slot);
+    }
+    tile->texid = 0;
+}
+
+void Loader::transcode_image(Tile* tile, SDL_Surface* texture, GLenum texture_format) {
+    if (SDL_MUSTLOCK(texture)) {
+        SDL_LockSurface(texture);
+    }
+    texcache_write(TILE_DIR + tile->get_cache_filename(), texture, texture_format);
+    if (SDL_MUSTLOCK(texture)) {
+        SDL_UnlockSurface(texture);
+    }
+    SDL_FreeSurface(texture);
+    CacheManager::instance()->touch(tile->source, tile->zoom, tile->x, tile->y);
 }
 
 void Loader::load_image(Tile& tile) {
+    // Beyond its highest zoom level a source is drawn from the tiles of lower zoom levels
+    if (tile.zoom > tile.source->max_zoom) {
+        return;
+    }
     std::string filename = TILE_DIR + tile.get_filename();
     if (!boost::filesystem::exists(filename)) {
+        downloads_pending++;
         ioService.post(boost::bind(&Loader::download_image, this, &tile));
         return;
     }
     if (boost::filesystem::file_size(filename) == 0) {
         boost::filesystem::remove(filename);
+        downloads_pending++;
         ioService.post(boost::bind(&Loader::download_image, this, &tile));
         return;
     }
 
+    if (!tile.source->texture) {
+        CacheManager::instance()->touch(tile.source, tile.zoom, tile.x, tile.y);
+        tile.texid = 0;
+        return;
+    }
     open_image(tile);
 }
 
 void Loader::open_image(Tile &tile) {
     std::string filename = TILE_DIR + tile.get_filename();
-    SDL_Surface *texture = IMG_Load(filename.c_str());
 
     char tmp[4096];
     getcwd(tmp, 4096);
     std::cout << "Loading texture " << filename << " from directory " << tmp << ' ';
 
-    if (texture) {
-        if (SDL_MUSTLOCK(texture)) {
-            SDL_LockSurface(texture);
-        }
+    // Another process may have decoded the tile already
+    s_shm_image shared;
+    if (shared_tile(&tile) && ShmCache::instance()->acquire(tile.zoom, tile.x, tile.y, shared)) {
+        tile.texid = upload_pixels(shared);
+        ShmCache::instance()->release(shared);
+        CacheManager::instance()->touch(tile.source, tile.zoom, tile.x, tile.y);
+        std::cout << "SUCCESS (shared)" << std::endl;
+        return;
+    }
 
-        GLenum texture_format;
-        if (texture->format->BytesPerPixel == 4) {
-            if (texture->format->Rmask == 0x000000ff) {
-                texture_format = GL_RGBA;
-            } else {
-                texture_format = GL_BGRA;
-            }
-        } else if (texture->format->BytesPerPixel == 3) {
-            if (texture->format->Rmask == 0x000000ff) {
-                texture_format = GL_RGB;
-            } else {
-                texture_format = GL_BGR;
-            }
-        } else {
-            std::cout << "INVALID (" << SDL_GetPixelFormatName(texture->format->format);
-            SDL_PixelFormat* format = SDL_AllocFormat(SDL_PIXELFORMAT_BGR24);
-            SDL_Surface* tmp = SDL_ConvertSurface(texture, format, 0);
-            texture_format = GL_BGR;
-            if (SDL_MUSTLOCK(texture)) {
-                SDL_UnlockSurface(texture);
-            }
-            SDL_FreeSurface(texture);
-            texture = tmp;
-            if (SDL_MUSTLOCK(texture)) {
-                SDL_LockSurface(texture);
-            }
-            std::cout << " -> " << SDL_GetPixelFormatName(texture->format->format) << ") ";
+    // Prefer the transcoded copy, it can be uploaded without decoding the PNG
+    if (cache_config.transcode) {
+        MappedTexture cached(TILE_DIR + tile.get_cache_filename());
+        if (cached.valid()) {
+            tile.texid = cached.upload();
+            CacheManager::instance()->touch(tile.source, tile.zoom, tile.x, tile.y);
+            std::cout << "SUCCESS (transcoded)" << std::endl;
+            return;
         }
+    }
 
-        GLuint texid;
-        glGenTextures(1, &texid);
-        glBindTexture(GL_TEXTURE_2D, texid);
-
-        glTexImage2D(GL_TEXTURE_2D, 0, 3, texture->w, texture->h, 0, texture_format, GL_UNSIGNED_BYTE, texture->pixels);
+    SDL_Surface *texture = IMG_Load(filename.c_str());
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if (texture) {
+        GLenum texture_format = surface_format(texture);
+        GLuint texid = upload_surface(texture, texture_format);
+        share_surface(&tile, texture, texture_format);
 
-        if (SDL_MUSTLOCK(texture)) {
-            SDL_UnlockSurface(texture);
+        // Hand the decoded pixels to a worker to fill the transcoded cache lazily
+        if (cache_config.transcode) {
+            ioService.post(boost::bind(&Loader::transcode_image, this, &tile, texture, texture_format));
+        } else {
+            SDL_FreeSurface(texture);
+            CacheManager::instance()->touch(tile.source, tile.zoom, tile.x, tile.y);
         }
-        SDL_FreeSurface(texture);
 
         tile.texid = texid;
 
@@ -166,3 +479,113 @@ void Loader::open_image(Tile &tile) {
     }
 
 }
+
+void Loader::prefetch_image(Tile& tile) {
+    std::string filename = TILE_DIR + tile.get_filename();
+    if (!boost::filesystem::exists(filename) || boost::filesystem::file_size(filename) == 0) {
+        load_image(tile);
+        return;
+    }
+    decoding++;
+    ioService.post(boost::bind(&Loader::decode_image, this, &tile));
+}
+
+void Loader::decode_image(Tile* tile) {
+    s_decoded_image image = { tile, nullptr, 0, nullptr, s_shm_image() };
+
+    if (shared_tile(tile) && ShmCache::instance()->acquire(tile->zoom, tile->x, tile->y, image.shared)) {
+        boost::lock_guard<boost::mutex> lock(decoded_mutex);
+        decoded.push_back(image);
+        decoding--;
+        return;
+    }
+
+    if (cache_config.transcode) {
+        MappedTexture* cached = new MappedTexture(TILE_DIR + tile->get_cache_filename());
+        if (cached->valid()) {
+            cached->prefault();
+            image.cached = cached;
+        } else {
+            delete cached;
+        }
+    }
+
+    if (image.cached == nullptr) {
+        std::string filename = TILE_DIR + tile->get_filename();
+        image.texture = IMG_Load(filename.c_str());
+        if (image.texture) {
+            image.texture_format = surface_format(image.texture);
+            share_surface(tile, image.texture, image.texture_format);
+            if (cache_config.transcode) {
+                if (SDL_MUSTLOCK(image.texture)) {
+                    SDL_LockSurface(image.texture);
+                }
+                texcache_write(TILE_DIR + tile->get_cache_filename(), image.texture, image.texture_format);
+                if (SDL_MUSTLOCK(image.texture)) {
+                    SDL_UnlockSurface(image.texture);
+                }
+            }
+        }
+    }
+
+    boost::lock_guard<boost::mutex> lock(decoded_mutex);
+    decoded.push_back(image);
+    decoding--;
+}
+
+size_t Loader::upload_images(size_t count) {
+    std::vector<s_decoded_image> batch;
+    {
+        boost::lock_guard<boost::mutex> lock(decoded_mutex);
+        count = std::min(count, decoded.size());
+        batch.assign(decoded.begin(), decoded.begin() + count);
+        decoded.erase(decoded.begin(), decoded.begin() + count);
+    }
+
+    for (s_decoded_image& image : batch) {
+        if (image.shared.pixels != nullptr) {
+            image.tile->texid = upload_pixels(image.shared);
+            ShmCache::instance()->release(image.shared);
+        } else if (image.cached != nullptr) {
+            image.tile->texid = image.cached->upload();
+            delete image.cached;
+        } else if (image.texture) {
+            image.tile->texid = upload_surface(image.texture, image.texture_format);
+            SDL_FreeSurface(image.texture);
+        } else {
+            image.tile->texid = TileFactory::instance()->get_dummy();
+            continue;
+        }
+        CacheManager::instance()->touch(image.tile->source, image.tile->zoom, image.tile->x, image.tile->y);
+    }
+    return batch.size();
+}
+
+size_t Loader::pending_images() {
+    boost::lock_guard<boost::mutex> lock(decoded_mutex);
+    return decoding + decoded.size();
+}
+
+bool Loader::fetch_image(Tile& tile) {
+    std::string filename = TILE_DIR + tile.get_filename();
+    if (!boost::filesystem::exists(filename) || boost::filesystem::file_size(filename) == 0) {
+        downloads_pending++;
+        download_image(&tile);
+    }
+    return boost::filesystem::exists(filename) && boost::filesystem::file_size(filename) > 0;
+}
+
+size_t Loader::pending_downloads() {
+    return downloads_pending;
+}
+
+void Loader::print_statistics() {
+    boost::lock_guard<boost::mutex> lock(downloads_mutex);
+    if (!statistics.latencies.empty()) {
+        report_statistics();
+    }
+}
+
+void Loader::post(boost::function<void()> task) {
+    ioService.post(task);
+}
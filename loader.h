@@ -27,11 +27,28 @@
 
 #include <iostream>
 
+#include <SDL2/SDL.h>
+#include <boost/function.hpp>
+
 #include "tile.h"
+#include "global.h"
+#include "cachemanager.h"
+#include "shmcache.h"
+
+/**
+ * @brief print the download statistics after this many downloads
+ */
+#define LOADER_STATISTICS_INTERVAL (100)
 
 class Loader {
 public:
     static Loader* instance() {
+        // The loader threads use these until they are joined, creating them
+        // first makes sure they are destroyed after the loader
+        CacheManager::instance();
+        if (cache_config.shared) {
+            ShmCache::instance();
+        }
         static CGuard g;
         if (!_instance) {
             _instance = new Loader();
@@ -41,13 +58,52 @@ public:
 
     void load_image(Tile& tile);
     void open_image(Tile& tile);
+    /**
+     * @brief load a tile by decoding it on the loader threads
+     *
+     * The texture is created by a later call to upload_images().
+     */
+    void prefetch_image(Tile& tile);
+    /**
+     * @brief upload tiles decoded by prefetch_image(), must be called from the render thread
+     * @param count the maximum number of textures to upload
+     * @return the number of uploaded textures
+     */
+    size_t upload_images(size_t count);
+    /**
+     * @brief the number of prefetched tiles not uploaded yet
+     */
+    size_t pending_images();
+    /**
+     * @brief download a tile unless it is in the tile directory already, blocking the calling thread
+     * @return true, if the tile is available in the tile directory
+     */
+    bool fetch_image(Tile& tile);
+    /**
+     * @brief the number of downloads queued or running on the loader threads
+     */
+    size_t pending_downloads();
+    /**
+     * @brief print the download statistics collected since the last report
+     */
+    void print_statistics();
+    /**
+     * @brief run a task on the loader threads
+     */
+    void post(boost::function<void()> task);
 private:
     static Loader* _instance;
     Loader();
     Loader(const Loader&) {}
     ~Loader();
 
+    /**
+     * @brief download a tile unless the same tile is downloaded already
+     */
     void download_image(Tile* tile);
+    void download_file(Tile* tile);
+    void decode_image(Tile* tile);
+    void transcode_image(Tile* tile, SDL_Surface* texture, GLenum texture_format);
 
     class CGuard {
     public:
@@ -0,0 +1,501 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Load test of the tile loader
+ *
+ * A small HTTP server on a pool of threads inside the process serves a
+ * generated tile with configurable latency, bandwidth and error rate. The
+ * map_source points at it and a number of simulated viewports wander across
+ * the map, requesting the tiles around them through the TileFactory like
+ * render() does. At the end the end-to-end latencies, the failures and the
+ * requests the server saw more than once are reported, next to the statistics
+ * of the loader itself.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL_opengl.h>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "../tile.h"
+#include "../loader.h"
+#include "../input.h"
+#include "../global.h"
+
+/**
+ * @brief the size of the chunks the server writes when the bandwidth is limited
+ */
+#define LOADTEST_CHUNK_SIZE (4096)
+
+/**
+ * @brief the edge length of the single colored blocks of the generated tile
+ */
+#define LOADTEST_BLOCK_SIZE (16)
+
+/**
+ * @brief the lowest zoom level the viewports use, lower levels have too few tiles
+ */
+#define LOADTEST_MIN_ZOOM (8)
+
+/**
+ * @brief how far a viewport moves per step in tiles
+ */
+#define LOADTEST_SPEED (0.5)
+
+/**
+ * @brief the chance of a viewport zooming in or out per step
+ */
+#define LOADTEST_ZOOM_CHANCE (0.05)
+
+/**
+ * @brief give up if no download finished for this long in milliseconds
+ */
+#define LOADTEST_STALL_TIMEOUT (30000)
+
+struct s_loadtest_config {
+    /**
+     * @brief the number of tiles to request
+     */
+    size_t requests = 20000;
+    size_t viewports = 16;
+    /**
+     * @brief the time between two steps of a viewport in milliseconds
+     */
+    int step = 50;
+    /**
+     * @brief the mean response time of the server in milliseconds, jittered by +-50%
+     */
+    int latency = 20;
+    /**
+     * @brief the bandwidth per connection in kB/s, 0 for unlimited
+     */
+    int bandwidth = 0;
+    /**
+     * @brief the share of the requests answered with "500 Internal Server Error"
+     */
+    double error_rate = 0.01;
+    /**
+     * @brief the edge length of the served tile in pixels
+     */
+    int tile_size = 256;
+    int server_threads = 16;
+};
+
+/**
+ * @brief a simulated user panning and zooming the map
+ */
+struct s_viewport {
+    int zoom;
+    /**
+     * @brief the center in tile coordinates of the current zoom level
+     */
+    double x;
+    double y;
+    double heading;
+};
+
+/**
+ * @brief an HTTP server answering every GET with the same tile
+ */
+class MockServer {
+public:
+    MockServer(const s_loadtest_config& config, const std::string& tile);
+    ~MockServer();
+    unsigned short port();
+    unsigned long requests();
+    unsigned long errors();
+    /**
+     * @brief the number of successful responses for a tile served successfully before
+     */
+    unsigned long duplicates();
+private:
+    typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+    void accept();
+    void accepted(socket_ptr socket, const boost::system::error_code& error);
+    void handle(socket_ptr socket);
+
+    const s_loadtest_config& config;
+    std::string tile;
+    boost::asio::io_service service;
+    boost::asio::ip::tcp::acceptor acceptor;
+    boost::thread_group pool;
+    std::atomic<unsigned long> seed;
+    std::atomic<unsigned long> served_requests;
+    std::atomic<unsigned long> served_errors;
+    boost::mutex mutex;
+    /**
+     * @brief the successful responses per path, guarded by mutex
+     */
+    std::unordered_map<std::string, unsigned long> served;
+};
+
+MockServer::MockServer(const s_loadtest_config& config, const std::string& tile) :
+    config(config), tile(tile), acceptor(service), seed(1), served_requests(0), served_errors(0) {
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), 0);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+    accept();
+    for (int i = 0; i < config.server_threads; i++) {
+        pool.create_thread(boost::bind(&boost::asio::io_service::run, &service));
+    }
+}
+
+MockServer::~MockServer() {
+    service.stop();
+    pool.join_all();
+}
+
+unsigned short MockServer::port() {
+    return acceptor.local_endpoint().port();
+}
+
+unsigned long MockServer::requests() {
+    return served_requests;
+}
+
+unsigned long MockServer::errors() {
+    return served_errors;
+}
+
+unsigned long MockServer::duplicates() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    unsigned long result = 0;
+    for (std::pair<std::string, unsigned long> path : served) {
+        result += path.second - 1;
+    }
+    return result;
+}
+
+void MockServer::accept() {
+    socket_ptr socket(new boost::asio::ip::tcp::socket(service));
+    acceptor.async_accept(*socket, boost::bind(&MockServer::accepted, this, socket, boost::asio::placeholders::error));
+}
+
+void MockServer::accepted(socket_ptr socket, const boost::system::error_code& error) {
+    // Accept the next connection first, the handler blocks this thread until the response is sent
+    accept();
+    if (!error) {
+        handle(socket);
+    }
+}
+
+void MockServer::handle(socket_ptr socket) {
+    boost::system::error_code ec;
+    boost::asio::streambuf request;
+    boost::asio::read_until(*socket, request, "\r\n\r\n", ec);
+    if (ec) {
+        return;
+    }
+    std::istream stream(&request);
+    std::string method, path;
+    stream >> method >> path;
+    served_requests++;
+
+    std::minstd_rand random(seed++);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    boost::this_thread::sleep(boost::posix_time::microseconds((long)(config.latency * 1000 * (0.5 + uniform(random)))));
+
+    if (uniform(random) < config.error_rate) {
+        served_errors++;
+        std::string response = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        boost::asio::write(*socket, boost::asio::buffer(response), ec);
+        return;
+    }
+
+    std::stringstream header;
+    header << "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: " << tile.size() << "\r\nConnection: close\r\n\r\n";
+    boost::asio::write(*socket, boost::asio::buffer(header.str()), ec);
+    size_t chunk = config.bandwidth > 0 ? LOADTEST_CHUNK_SIZE : tile.size();
+    for (size_t offset = 0; offset < tile.size() && !ec; offset += chunk) {
+        size_t length = std::min(chunk, tile.size() - offset);
+        boost::asio::write(*socket, boost::asio::buffer(tile.data() + offset, length), ec);
+        if (config.bandwidth > 0) {
+            boost::this_thread::sleep(boost::posix_time::microseconds(length * 1000000 / (config.bandwidth * 1024)));
+        }
+    }
+    if (!ec) {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        served[path]++;
+    }
+}
+
+/**
+ * @brief create a PNG of random colored blocks, so it does not compress to nothing
+ * @return the encoded PNG, empty on failure
+ */
+static std::string generate_tile(int size) {
+    SDL_Surface* surface = SDL_CreateRGBSurface(0, size, size, 24, 0x0000ff, 0x00ff00, 0xff0000, 0);
+    if (!surface) {
+        return "";
+    }
+    std::minstd_rand random(size);
+    int blocks = (size + LOADTEST_BLOCK_SIZE - 1) / LOADTEST_BLOCK_SIZE;
+    std::vector<unsigned char> colors(blocks * blocks * 3);
+    for (unsigned char& color : colors) {
+        color = random() % 256;
+    }
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_LockSurface(surface);
+    }
+    for (int y = 0; y < size; y++) {
+        unsigned char* row = (unsigned char*)surface->pixels + y * surface->pitch;
+        for (int x = 0; x < size; x++) {
+            unsigned char* color = &colors[((y / LOADTEST_BLOCK_SIZE) * blocks + x / LOADTEST_BLOCK_SIZE) * 3];
+            std::copy(color, color + 3, row + x * 3);
+        }
+    }
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_UnlockSurface(surface);
+    }
+    std::string file = "loadtest.png";
+    int saved = IMG_SavePNG(surface, file.c_str());
+    SDL_FreeSurface(surface);
+    if (saved != 0) {
+        return "";
+    }
+    std::ifstream stream(file.c_str(), std::ios::binary);
+    std::stringstream data;
+    data << stream.rdbuf();
+    boost::filesystem::remove(file);
+    return data.str();
+}
+
+/**
+ * @brief move the viewport on, turning and zooming at random
+ */
+static void step_viewport(s_viewport& viewport, std::minstd_rand& random) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> turn(0.0, 0.3);
+    viewport.heading += turn(random);
+    double zoom_roll = uniform(random);
+    if (zoom_roll < LOADTEST_ZOOM_CHANCE / 2 && viewport.zoom < MAX_ZOOM) {
+        viewport.zoom++;
+        viewport.x *= 2;
+        viewport.y *= 2;
+    } else if (zoom_roll < LOADTEST_ZOOM_CHANCE && viewport.zoom > LOADTEST_MIN_ZOOM) {
+        viewport.zoom--;
+        viewport.x /= 2;
+        viewport.y /= 2;
+    }
+    double tiles = 1 << viewport.zoom;
+    viewport.x = fmod(viewport.x + cos(viewport.heading) * LOADTEST_SPEED + tiles, tiles);
+    viewport.y = std::max(4.0, std::min(tiles - 5, viewport.y + sin(viewport.heading) * LOADTEST_SPEED));
+}
+
+static double percentile(const std::vector<long>& sorted, size_t percent) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    s_loadtest_config config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--requests" && i + 1 < argc) {
+            config.requests = atol(argv[++i]);
+        } else if (arg == "--viewports" && i + 1 < argc) {
+            config.viewports = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--step" && i + 1 < argc) {
+            config.step = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--latency" && i + 1 < argc) {
+            config.latency = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--bandwidth" && i + 1 < argc) {
+            config.bandwidth = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--error-rate" && i + 1 < argc) {
+            config.error_rate = atof(argv[++i]);
+        } else if (arg == "--tile-size" && i + 1 < argc) {
+            config.tile_size = std::max(LOADTEST_BLOCK_SIZE, atoi(argv[++i]));
+        } else if (arg == "--server-threads" && i + 1 < argc) {
+            config.server_threads = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--requests <n>] [--viewports <n>] [--step <ms>] [--latency <ms>] [--bandwidth <kB/s>] [--error-rate <0..1>] [--tile-size <px>] [--server-threads <n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    // The tiles are stored in the current directory, start with an empty one
+    boost::filesystem::path directory = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("slippymap3d-loadtest-%%%%-%%%%");
+    boost::filesystem::create_directories(directory);
+    boost::filesystem::current_path(directory);
+
+    // The textures need a GL context, e.g. SDL_VIDEODRIVER=offscreen or xvfb-run on a headless machine
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "Could not initialize SDL video: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    SDL_Window* window = SDL_CreateWindow("slippymap3d loadtest", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 64, 64, SDL_WINDOW_HIDDEN | SDL_WINDOW_OPENGL);
+    SDL_GLContext context = window ? SDL_GL_CreateContext(window) : nullptr;
+    if (!context) {
+        std::cerr << "Could not create a GL context: " << SDL_GetError() << std::endl;
+        SDL_Quit();
+        return 1;
+    }
+
+    std::string tile = generate_tile(config.tile_size);
+    if (tile.empty()) {
+        std::cerr << "Could not generate the tile: " << IMG_GetError() << std::endl;
+        return 1;
+    }
+
+    int result = 0;
+    {
+        MockServer server(config, tile);
+        std::stringstream url;
+        url << "http://127.0.0.1:" << server.port() << "/";
+        map_source.url = url.str();
+        std::cout << "Load test: " << config.requests << " tiles of " << tile.size() << " bytes for "
+                  << config.viewports << " viewports from " << map_source.url << " in " << directory.string() << std::endl;
+
+        std::minstd_rand random(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<s_viewport> viewports;
+        for (size_t i = 0; i < config.viewports; i++) {
+            s_viewport viewport;
+            viewport.zoom = LOADTEST_MIN_ZOOM + random() % (MAX_ZOOM - LOADTEST_MIN_ZOOM + 1);
+            viewport.x = long2tilexf(uniform(random) * 360.0 - 180.0, viewport.zoom);
+            viewport.y = lat2tileyf(MIN_LATITUDE + uniform(random) * (MAX_LATITUDE - MIN_LATITUDE), viewport.zoom);
+            viewport.heading = uniform(random) * 2 * M_PI;
+            viewports.push_back(viewport);
+        }
+
+        std::unordered_set<Tile*> requested;
+        std::unordered_map<Tile*, std::chrono::steady_clock::time_point> outstanding;
+        std::vector<long> latencies;
+        GLuint dummy = TileFactory::instance()->get_dummy();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point progress = start;
+        size_t pending = 0;
+        while (true) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            // Request the tiles around each viewport, like render() does
+            if (requested.size() < config.requests) {
+                for (s_viewport& viewport : viewports) {
+                    step_viewport(viewport, random);
+                    int center_x = (int)floor(viewport.x);
+                    int center_y = (int)floor(viewport.y);
+                    int tiles = 1 << viewport.zoom;
+                    for (int y = center_y - 4; y <= center_y + 4 && requested.size() < config.requests; y++) {
+                        for (int x = center_x - 4; x <= center_x + 4 && requested.size() < config.requests; x++) {
+                            Tile* tile = TileFactory::instance()->get_tile(viewport.zoom, (x + tiles) % tiles, y);
+                            if (requested.insert(tile).second) {
+                                outstanding[tile] = now;
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Upload the downloaded tiles, like render() does for the visible ones
+            for (std::unordered_map<Tile*, std::chrono::steady_clock::time_point>::iterator it = outstanding.begin(); it != outstanding.end();) {
+                Tile* tile = it->first;
+                if (tile->texid == 0) {
+                    Loader::instance()->open_image(*tile);
+                }
+                GLuint texid = tile->texid;
+                if (texid != 0 && texid != dummy) {
+                    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - it->second).count());
+                    // Nothing is drawn, keep the memory usage down to the loader's own
+                    glDeleteTextures(1, &texid);
+                    it = outstanding.erase(it);
+                } else {
+                    it++;
+                }
+            }
+
+            // The downloads are usually far behind the viewports, only give up if they stall
+            if (Loader::instance()->pending_downloads() != pending) {
+                pending = Loader::instance()->pending_downloads();
+                progress = now;
+            }
+            if (requested.size() >= config.requests) {
+                bool waiting = pending > 0;
+                for (std::pair<Tile*, std::chrono::steady_clock::time_point> tile : outstanding) {
+                    waiting = waiting || tile.first->texid == 0;
+                }
+                if (!waiting) {
+                    break;
+                }
+                if (std::chrono::duration_cast<std::chrono::milliseconds>(now - progress).count() > LOADTEST_STALL_TIMEOUT) {
+                    std::cerr << "Load test: timed out waiting for " << pending << " downloads" << std::endl;
+                    result = 1;
+                    break;
+                }
+            }
+            SDL_Delay(requested.size() < config.requests ? config.step : 1);
+        }
+
+        double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+        std::sort(latencies.begin(), latencies.end());
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        Loader::instance()->print_statistics();
+        std::cout << "Load test: " << requested.size() << " tiles requested in " << seconds << " s, "
+                  << latencies.size() << " loaded (" << (latencies.size() / std::max(seconds, 0.001)) << " tiles/s), "
+                  << outstanding.size() << " failed, latency p50 " << percentile(latencies, 50) << " ms p95 "
+                  << percentile(latencies, 95) << " ms p99 " << percentile(latencies, 99) << " ms max "
+                  << percentile(latencies, 100) << " ms, server " << server.requests() << " requests ("
+                  << server.errors() << " errors, " << server.duplicates() << " duplicate tiles), max RSS "
+                  << (usage.ru_maxrss / 1024) << " MB" << std::endl;
+
+        // Every tile is fetched once, only the errors of the server leave tiles behind
+        if (server.duplicates() > 0 || outstanding.size() != server.errors()) {
+            std::cerr << "Load test: FAILED" << std::endl;
+            result = 1;
+        }
+    }
+
+    SDL_GL_DeleteContext(context);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    boost::filesystem::current_path(boost::filesystem::temp_directory_path());
+    boost::filesystem::remove_all(directory);
+    return result;
+}
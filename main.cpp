@@ -32,9 +32,30 @@
 
 #include "tile.h"
 #include "loader.h"
+#include "cachemanager.h"
+#include "session.h"
+#include "track.h"
+#include "poi.h"
+#include "terrain.h"
+#include "vectortile.h"
+#include "export.h"
 #include "input.h"
 #include "global.h"
 
+/**
+ * @brief maximum time to wait for the restored session before the first frame
+ */
+#define SESSION_RESTORE_TIMEOUT (500)
+
+/**
+ * @brief interval for saving the session in milliseconds
+ */
+#define SESSION_SAVE_INTERVAL (30000)
+
+/**
+ * @brief maximum number of prefetched tiles uploaded per frame
+ */
+#define UPLOADS_PER_FRAME (16)
 
 /**
  * @brief poll for events
@@ -79,16 +100,23 @@ bool poll() {
     return true;
 }
 
-void render(int zoom, double latitude, double longitude) {
-    Tile* center_tile = TileFactory::instance()->get_tile(zoom, latitude, longitude);
+/**
+ * @brief render the map around the given position
+ * @return true, if every visible tile had its texture available
+ */
+bool render(int zoom, double latitude, double longitude) {
+    bool complete = true;
+    s_tile_source* source = vector_config.enabled ? &vector_source : &map_source;
+    Tile* center_tile = TileFactory::instance()->get_tile(source, zoom, latitude, longitude);
+    unsigned int now = SDL_GetTicks();
 
     // Clear with black
     glClearColor(0.0, 0.0, 0.0, 0.0);
-    glClear(GL_COLOR_BUFFER_BIT);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    glOrtho(-(window_state.width / 2), (window_state.width / 2), (window_state.height / 2), -(window_state.height / 2), -1000, 1000);
+    glOrtho(-(window_state.width / 2), (window_state.width / 2), (window_state.height / 2), -(window_state.height / 2), -20000, 20000);
 
     // Rotate and and tilt the world geometry
     glRotated(viewport_state.angle_tilt, 1.0, 0.0, 0.0);
@@ -96,6 +124,9 @@ void render(int zoom, double latitude, double longitude) {
 
     // Render the slippy map parts
     glEnable(GL_TEXTURE_2D);
+    if (terrain_config.enabled) {
+        glEnable(GL_DEPTH_TEST);
+    }
 
         // Top left coordinate of the current tile
         double tile_latitude = tiley2lat(center_tile->y, zoom);
@@ -113,6 +144,12 @@ void render(int zoom, double latitude, double longitude) {
             static const int bottom = 5;
             static const int right = 5;
 
+            // Never evict what is currently on screen
+            CacheManager::instance()->set_view(zoom, center_tile->x + left, center_tile->y + top, center_tile->x + right - 1, center_tile->y + bottom - 1);
+
+            // Raise or lower the terrain, so it is at zero height below the player
+            Terrain::instance()->set_reference(zoom, latitude, longitude);
+
             // Start 'left' and 'top' tiles from the center tile and render down to 'bottom' and
             // 'right' tiles from the center tile
             Tile* current = center_tile->get(left, top);
@@ -121,28 +158,51 @@ void render(int zoom, double latitude, double longitude) {
 
                     // If the texid is set to zero the download was finished successfully and
                     // the tile can be rendered now properly
-                    if (current->texid == 0) {
+                    if (current->texid == 0 && current->source->texture) {
                         Loader::instance()->open_image(*current);
                     }
+                    if (current->source->texture && (current->texid == 0 || current->texid == TileFactory::instance()->get_dummy())) {
+                        complete = false;
+                    }
+                    current->last_used = now;
 
-                    // Render the tile itself at the correct position
+                    // Render the tile itself at the correct position, draped over the terrain
+                    // if available
                     glPushMatrix();
                         glTranslated(x*TILE_SIZE*2, y*TILE_SIZE*2, 0);
-                        glBindTexture(GL_TEXTURE_2D, current->texid);
-                        glBegin(GL_QUADS);
-                            glTexCoord2f(0.0, 1.0); glVertex3f(-TILE_SIZE,  TILE_SIZE, 0);
-                            glTexCoord2f(1.0, 1.0); glVertex3f( TILE_SIZE,  TILE_SIZE, 0);
-                            glTexCoord2f(1.0, 0.0); glVertex3f( TILE_SIZE, -TILE_SIZE, 0);
-                            glTexCoord2f(0.0, 0.0); glVertex3f(-TILE_SIZE, -TILE_SIZE, 0);
-                        glEnd();
+                        if (!current->source->texture) {
+                            glDisable(GL_TEXTURE_2D);
+                            if (!VectorTiles::instance()->draw_tile(current)) {
+                                complete = false;
+                            }
+                            glEnable(GL_TEXTURE_2D);
+                        } else {
+                            glBindTexture(GL_TEXTURE_2D, current->texid);
+                            if (!Terrain::instance()->draw_tile(current, viewport_state.angle_tilt)) {
+                                glBegin(GL_QUADS);
+                                    glTexCoord2f(0.0, 1.0); glVertex3f(-TILE_SIZE,  TILE_SIZE, 0);
+                                    glTexCoord2f(1.0, 1.0); glVertex3f( TILE_SIZE,  TILE_SIZE, 0);
+                                    glTexCoord2f(1.0, 0.0); glVertex3f( TILE_SIZE, -TILE_SIZE, 0);
+                                    glTexCoord2f(0.0, 0.0); glVertex3f(-TILE_SIZE, -TILE_SIZE, 0);
+                                glEnd();
+                            }
+                        }
                     glPopMatrix();
                     current = current->get_west();
                 }
                 current = current->get(-(std::abs(left) + std::abs(right)), 1);
             }
         glPopMatrix();
+    glDisable(GL_DEPTH_TEST);
     glDisable(GL_TEXTURE_2D);
 
+    // Draw the overlays in the same coordinate system as the tiles
+    glPushMatrix();
+        glTranslated(lon_diff, lat_diff, 0);
+        TrackLayer::instance()->draw(center_tile, left, top, right, bottom);
+        PoiLayer::instance()->draw(center_tile, left, top, right, bottom);
+    glPopMatrix();
+
     // Draw the players avatar at the center of the screen
     glColor3d(1.0, 0.5, 0.0);
     glBegin(GL_TRIANGLES);
@@ -151,9 +211,51 @@ void render(int zoom, double latitude, double longitude) {
         glVertex3f(  0, -10, 1);
     glEnd();
     glColor3d(1.0, 1.0, 1.0);
+
+    return complete;
 }
 
-int main() {
+int main(int argc, char** argv) {
+
+    struct timespec spec;
+    clock_gettime(CLOCK_REALTIME, &spec);
+    long start_time = spec.tv_sec * 1000 + round(spec.tv_nsec / 1.0e6);
+    bool first_full_view = false;
+    std::string export_file;
+
+    // The loader threads build terrain and vector meshes until they are joined, creating
+    // their owners before the loader makes sure they are destroyed after the loader
+    Terrain::instance();
+    VectorTiles::instance();
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--track" && i + 1 < argc) {
+            TrackLayer::instance()->load(argv[++i]);
+        } else if (arg == "--poi" && i + 1 < argc) {
+            PoiLayer::instance()->load(argv[++i]);
+        } else if (arg == "--terrain") {
+            terrain_config.enabled = true;
+        } else if (arg == "--vector") {
+            vector_config.enabled = true;
+        } else if (arg == "--export" && i + 1 < argc) {
+            export_file = argv[++i];
+        } else if (arg == "--tile-url" && i + 1 < argc) {
+            map_source.url = argv[++i];
+        } else if (arg == "--shared-cache") {
+            cache_config.shared = true;
+        } else if (arg == "--transcode") {
+            cache_config.transcode = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--track <file.gpx|file.csv>]... [--poi <file.csv>]... [--terrain] [--vector] [--shared-cache] [--transcode] [--tile-url <url>] [--export <batch.txt>]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Static images are rendered without a window
+    if (!export_file.empty()) {
+        return export_batch(export_file);
+    }
 
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -161,7 +263,8 @@ int main() {
         return 1;
     }
 
-    // Create an OpenGL window
+    // Create an OpenGL window, the terrain needs a depth buffer
+    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
     SDL_Window* window = SDL_CreateWindow("slippymap3d", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1024, 768, SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
     if (!window) {
         std::cerr << "Could not create SDL window: " << SDL_GetError() << std::endl;
@@ -171,8 +274,19 @@ int main() {
     SDL_GetWindowSize(window, &window_state.width, &window_state.height);
     SDL_GLContext context = SDL_GL_CreateContext(window);
 
-    struct timespec spec;
+    // Decode the tiles of the last session on the loader threads and give them a moment to
+    // arrive, so the first frame is already complete
+    if (restore_session()) {
+        unsigned int restore_start = SDL_GetTicks();
+        while (Loader::instance()->pending_images() > 0 && (SDL_GetTicks() - restore_start) < SESSION_RESTORE_TIMEOUT) {
+            if (Loader::instance()->upload_images(SESSION_TILES) == 0) {
+                SDL_Delay(1);
+            }
+        }
+    }
+
     clock_gettime(CLOCK_REALTIME, &spec);
+    long save_time = spec.tv_sec * 1000 + round(spec.tv_nsec / 1.0e6);
     long base_time = spec.tv_sec * 1000 + round(spec.tv_nsec / 1.0e6);
     int frames = 0;
     while(true) {
@@ -189,11 +303,24 @@ int main() {
             frames=0;
         }
 
-        render(player_state.zoom, player_state.latitude, player_state.longitude);
+        if ((time_in_mill - save_time) > SESSION_SAVE_INTERVAL) {
+            save_session();
+            save_time = time_in_mill;
+        }
+
+        Loader::instance()->upload_images(UPLOADS_PER_FRAME);
+
+        // Report how long it took until the map was fully visible (e.g. to compare warm starts)
+        if (render(player_state.zoom, player_state.latitude, player_state.longitude) && !first_full_view) {
+            std::cout << "First full view after " << (time_in_mill - start_time) << " ms" << std::endl;
+            first_full_view = true;
+        }
 
         SDL_GL_SwapWindow(window);
     }
 
+    save_session();
+
     SDL_GL_DeleteContext(context);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -0,0 +1,307 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+
+#include "poi.h"
+#include "input.h"
+#include "global.h"
+
+PoiLayer* PoiLayer::_instance = nullptr;
+
+/**
+ * @brief the point size of the markers, by number of points in a cluster
+ */
+static const GLfloat marker_sizes[] = { 6.0, 10.0, 14.0, 18.0, 22.0 };
+
+static uint64_t cell_key(int x, int y) {
+    return ((uint64_t) (uint32_t) x << 32) | (uint32_t) y;
+}
+
+static int size_class(uint32_t count) {
+    if (count < 2) {
+        return 0;
+    } else if (count < 10) {
+        return 1;
+    } else if (count < 100) {
+        return 2;
+    } else if (count < 1000) {
+        return 3;
+    }
+    return 4;
+}
+
+PoiLayer::PoiLayer() {
+    thread = boost::thread(boost::bind(&PoiLayer::run, this));
+}
+
+PoiLayer::~PoiLayer() {
+    {
+        boost::lock_guard<boost::mutex> lock(pending_mutex);
+        running = false;
+    }
+    condition.notify_one();
+    thread.join();
+}
+
+void PoiLayer::update(uint64_t id, double latitude, double longitude) {
+    // Near the poles the tile coordinates overflow, keep the points within the map like the player
+    if (!std::isfinite(latitude) || !std::isfinite(longitude)) {
+        return;
+    }
+    latitude = std::max(std::min(latitude, MAX_LATITUDE), MIN_LATITUDE);
+    longitude = std::max(std::min(longitude, 180.0), -180.0);
+    s_update update = { id, false, long2tilexf(longitude, 0), lat2tileyf(latitude, 0) };
+    {
+        boost::lock_guard<boost::mutex> lock(pending_mutex);
+        pending.push_back(update);
+    }
+    condition.notify_one();
+}
+
+void PoiLayer::remove(uint64_t id) {
+    s_update update = { id, true, 0.0, 0.0 };
+    {
+        boost::lock_guard<boost::mutex> lock(pending_mutex);
+        pending.push_back(update);
+    }
+    condition.notify_one();
+}
+
+void PoiLayer::load(const std::string& filename) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        std::cerr << "Failed to open points " << filename << std::endl;
+        return;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        // Lines not starting with three numbers (e.g. headers) are skipped
+        char* end;
+        uint64_t id = strtoull(line.c_str(), &end, 10);
+        if (end == line.c_str() || *end != ',') {
+            continue;
+        }
+        char* start = end + 1;
+        double latitude = strtod(start, &end);
+        if (end == start || *end != ',') {
+            continue;
+        }
+        start = end + 1;
+        double longitude = strtod(start, &end);
+        if (end == start) {
+            continue;
+        }
+        update(id, latitude, longitude);
+    }
+}
+
+void PoiLayer::run() {
+    std::vector<s_update> updates;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(pending_mutex);
+            while (running && pending.empty()) {
+                condition.wait(lock);
+            }
+            if (!running) {
+                break;
+            }
+            updates.swap(pending);
+        }
+
+        // Apply the updates in batches, so the renderer never waits long for the index
+        for (size_t i = 0; i < updates.size(); i += POI_UPDATE_BATCH) {
+            boost::lock_guard<boost::mutex> lock(index_mutex);
+            size_t end = std::min(updates.size(), i + POI_UPDATE_BATCH);
+            for (size_t j = i; j < end; j++) {
+                apply(updates[j]);
+            }
+        }
+        updates.clear();
+    }
+}
+
+void PoiLayer::apply(const s_update& update) {
+    std::unordered_map<uint64_t, s_poi>::iterator existing = points.find(update.id);
+    if (update.removed) {
+        if (existing != points.end()) {
+            remove_from_index(update.id, existing->second);
+            points.erase(existing);
+        }
+        return;
+    }
+
+    double scale = pow(2.0, POI_CELL_ZOOM);
+    int cell_x = (int) floor(update.x * scale);
+    int cell_y = (int) floor(update.y * scale);
+
+    if (existing == points.end()) {
+        s_poi& poi = points[update.id];
+        poi.x = update.x;
+        poi.y = update.y;
+        poi.cell_x = cell_x;
+        poi.cell_y = cell_y;
+        add_to_index(update.id, poi);
+        return;
+    }
+
+    s_poi& poi = existing->second;
+    poi.x = update.x;
+    poi.y = update.y;
+    if (poi.cell_x == cell_x && poi.cell_y == cell_y) {
+        return;
+    }
+
+    // Move the point to its new tile
+    int shift = POI_CELL_ZOOM - POI_POINT_ZOOM;
+    if ((poi.cell_x >> shift) != (cell_x >> shift) || (poi.cell_y >> shift) != (cell_y >> shift)) {
+        std::vector<uint64_t>& old_tile = tiles[cell_key(poi.cell_x >> shift, poi.cell_y >> shift)];
+        points[old_tile.back()].slot = poi.slot;
+        old_tile[poi.slot] = old_tile.back();
+        old_tile.pop_back();
+        if (old_tile.empty()) {
+            tiles.erase(cell_key(poi.cell_x >> shift, poi.cell_y >> shift));
+        }
+        std::vector<uint64_t>& new_tile = tiles[cell_key(cell_x >> shift, cell_y >> shift)];
+        poi.slot = new_tile.size();
+        new_tile.push_back(update.id);
+    }
+
+    // Cells are nested, once the point stays within a cell it stays within all coarser ones
+    for (int zoom = POI_POINT_ZOOM - 1; zoom >= 0; zoom--) {
+        shift = POI_CELL_ZOOM - zoom - POI_CLUSTER_SHIFT;
+        uint64_t old_cell = cell_key(poi.cell_x >> shift, poi.cell_y >> shift);
+        uint64_t new_cell = cell_key(cell_x >> shift, cell_y >> shift);
+        if (old_cell == new_cell) {
+            break;
+        }
+        std::unordered_map<uint64_t, uint32_t>::iterator count = clusters[zoom].find(old_cell);
+        if (--count->second == 0) {
+            clusters[zoom].erase(count);
+        }
+        clusters[zoom][new_cell]++;
+    }
+
+    poi.cell_x = cell_x;
+    poi.cell_y = cell_y;
+}
+
+void PoiLayer::add_to_index(uint64_t id, s_poi& poi) {
+    int shift = POI_CELL_ZOOM - POI_POINT_ZOOM;
+    std::vector<uint64_t>& tile = tiles[cell_key(poi.cell_x >> shift, poi.cell_y >> shift)];
+    poi.slot = tile.size();
+    tile.push_back(id);
+
+    for (int zoom = POI_POINT_ZOOM - 1; zoom >= 0; zoom--) {
+        shift = POI_CELL_ZOOM - zoom - POI_CLUSTER_SHIFT;
+        clusters[zoom][cell_key(poi.cell_x >> shift, poi.cell_y >> shift)]++;
+    }
+}
+
+void PoiLayer::remove_from_index(uint64_t id, s_poi& poi) {
+    int shift = POI_CELL_ZOOM - POI_POINT_ZOOM;
+    uint64_t key = cell_key(poi.cell_x >> shift, poi.cell_y >> shift);
+    std::vector<uint64_t>& tile = tiles[key];
+    if (tile.back() != id) {
+        points[tile.back()].slot = poi.slot;
+        tile[poi.slot] = tile.back();
+    }
+    tile.pop_back();
+    if (tile.empty()) {
+        tiles.erase(key);
+    }
+
+    for (int zoom = POI_POINT_ZOOM - 1; zoom >= 0; zoom--) {
+        shift = POI_CELL_ZOOM - zoom - POI_CLUSTER_SHIFT;
+        std::unordered_map<uint64_t, uint32_t>::iterator count = clusters[zoom].find(cell_key(poi.cell_x >> shift, poi.cell_y >> shift));
+        if (--count->second == 0) {
+            clusters[zoom].erase(count);
+        }
+    }
+}
+
+void PoiLayer::draw(Tile* center, int left, int top, int right, int bottom) {
+    for (std::vector<GLfloat>& batch : vertices) {
+        batch.clear();
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(index_mutex);
+        if (center->zoom >= POI_POINT_ZOOM) {
+            // Draw every point of the tiles at POI_POINT_ZOOM covering the visible tiles
+            int shift = center->zoom - POI_POINT_ZOOM;
+            double scale = pow(2.0, center->zoom);
+            for (int y = (center->y + top) >> shift; y <= (center->y + bottom - 1) >> shift; y++) {
+                for (int x = (center->x + left) >> shift; x <= (center->x + right - 1) >> shift; x++) {
+                    std::unordered_map<uint64_t, std::vector<uint64_t> >::iterator tile = tiles.find(cell_key(x, y));
+                    if (tile == tiles.end()) {
+                        continue;
+                    }
+                    for (uint64_t id : tile->second) {
+                        s_poi& poi = points[id];
+                        vertices[0].push_back((poi.x * scale - center->x) * TILE_SIZE * 2 - TILE_SIZE);
+                        vertices[0].push_back((poi.y * scale - center->y) * TILE_SIZE * 2 - TILE_SIZE);
+                    }
+                }
+            }
+        } else {
+            // Draw a marker at the center of each cluster cell within the visible tiles
+            std::unordered_map<uint64_t, uint32_t>& level = clusters[center->zoom];
+            int cells = 1 << POI_CLUSTER_SHIFT;
+            for (int y = (center->y + top) * cells; y < (center->y + bottom) * cells; y++) {
+                for (int x = (center->x + left) * cells; x < (center->x + right) * cells; x++) {
+                    std::unordered_map<uint64_t, uint32_t>::iterator cluster = level.find(cell_key(x, y));
+                    if (cluster == level.end()) {
+                        continue;
+                    }
+                    std::vector<GLfloat>& batch = vertices[size_class(cluster->second)];
+                    batch.push_back(((x + 0.5) / cells - center->x) * TILE_SIZE * 2 - TILE_SIZE);
+                    batch.push_back(((y + 0.5) / cells - center->y) * TILE_SIZE * 2 - TILE_SIZE);
+                }
+            }
+        }
+    }
+
+    // One draw call per marker size
+    glEnable(GL_POINT_SMOOTH);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glColor3d(0.9, 0.1, 0.1);
+    for (size_t i = 0; i < sizeof(marker_sizes) / sizeof(marker_sizes[0]); i++) {
+        if (vertices[i].empty()) {
+            continue;
+        }
+        glPointSize(marker_sizes[i]);
+        glVertexPointer(2, GL_FLOAT, 0, vertices[i].data());
+        glDrawArrays(GL_POINTS, 0, vertices[i].size() / 2);
+    }
+    glColor3d(1.0, 1.0, 1.0);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPointSize(1.0);
+    glDisable(GL_POINT_SMOOTH);
+}
@@ -0,0 +1,161 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_POI_H_
+#define _SM3D_POI_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include <GL/gl.h>
+
+#include "tile.h"
+
+/**
+ * @brief from this zoom level on points are drawn individually instead of clustered
+ */
+#define POI_POINT_ZOOM (15)
+
+/**
+ * @brief clusters are formed of 2^POI_CLUSTER_SHIFT x 2^POI_CLUSTER_SHIFT cells per tile
+ */
+#define POI_CLUSTER_SHIFT (2)
+
+/**
+ * @brief the zoom level of the finest cluster cells
+ */
+#define POI_CELL_ZOOM (POI_POINT_ZOOM - 1 + POI_CLUSTER_SHIFT)
+
+/**
+ * @brief maximum number of updates applied at once, before the index is released again
+ */
+#define POI_UPDATE_BATCH (10000)
+
+/**
+ * @brief draws points of interest (e.g. vehicles of a fleet) on top of the map
+ *
+ * The points are indexed by their tile at POI_POINT_ZOOM. For the zoom levels
+ * below, the number of points per cluster cell is kept up to date for every
+ * zoom level. Moving a point only touches the cells it actually leaves, so
+ * updates never require rebuilding the index.
+ */
+class PoiLayer {
+public:
+    static PoiLayer* instance() {
+        static CGuard g;
+        if (!_instance) {
+            _instance = new PoiLayer();
+        }
+        return _instance;
+    }
+
+    /**
+     * @brief add or move a point, may be called from any thread
+     *
+     * Latitudes beyond MIN_LATITUDE and MAX_LATITUDE are clamped, points with
+     * coordinates that are not finite are ignored.
+     */
+    void update(uint64_t id, double latitude, double longitude);
+    /**
+     * @brief remove a point, may be called from any thread
+     */
+    void remove(uint64_t id);
+    /**
+     * @brief load points from a CSV file with the columns id, latitude and longitude
+     */
+    void load(const std::string& filename);
+    /**
+     * @brief draw the points or clusters within the visible tiles
+     * @param center the tile at the center of the screen, at the origin
+     * @param left the offset of the left most visible tile from the center tile
+     * @param top the offset of the top most visible tile from the center tile
+     * @param right the offset past the right most visible tile
+     * @param bottom the offset past the bottom most visible tile
+     */
+    void draw(Tile* center, int left, int top, int right, int bottom);
+private:
+    static PoiLayer* _instance;
+    PoiLayer();
+    PoiLayer(const PoiLayer&) {}
+    ~PoiLayer();
+
+    struct s_update {
+        uint64_t id;
+        bool removed;
+        double x;
+        double y;
+    };
+
+    struct s_poi {
+        /**
+         * @brief the position as tile coordinates at zoom level 0
+         */
+        double x;
+        double y;
+        /**
+         * @brief the cell at POI_CELL_ZOOM
+         */
+        int cell_x;
+        int cell_y;
+        /**
+         * @brief the position within the list of points of its tile
+         */
+        size_t slot;
+    };
+
+    boost::thread thread;
+    boost::mutex pending_mutex;
+    boost::condition_variable condition;
+    bool running = true;
+    std::vector<s_update> pending;
+
+    boost::mutex index_mutex;
+    std::unordered_map<uint64_t, s_poi> points;
+    std::unordered_map<uint64_t, std::vector<uint64_t> > tiles;
+    std::unordered_map<uint64_t, uint32_t> clusters[POI_POINT_ZOOM];
+
+    // Reused between frames to avoid allocations
+    std::vector<GLfloat> vertices[5];
+
+    void run();
+    void apply(const s_update& update);
+    void add_to_index(uint64_t id, s_poi& poi);
+    void remove_from_index(uint64_t id, s_poi& poi);
+
+    class CGuard {
+    public:
+        ~CGuard() {
+            if (PoiLayer::_instance != nullptr) {
+                delete PoiLayer::_instance;
+                PoiLayer::_instance = nullptr;
+            }
+        }
+    };
+    friend class CGuard;
+};
+
+#endif
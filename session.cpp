@@ -0,0 +1,90 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#include "session.h"
+#include "input.h"
+#include "tile.h"
+
+void save_session() {
+    std::string tmp = SESSION_FILE ".tmp";
+    std::ofstream out(tmp.c_str());
+    out.precision(10);
+    out << "position " << player_state.latitude << ' ' << player_state.longitude << ' ' << player_state.zoom << std::endl;
+    out << "viewport " << viewport_state.angle_rotate << ' ' << viewport_state.angle_tilt << std::endl;
+    for (Tile* tile : TileFactory::instance()->most_recent(SESSION_TILES)) {
+        out << "tile " << tile->zoom << ' ' << tile->x << ' ' << tile->y << std::endl;
+    }
+    out.close();
+    if (!out || rename(tmp.c_str(), SESSION_FILE) != 0) {
+        std::cerr << "Failed to save session to " << SESSION_FILE << std::endl;
+    }
+}
+
+bool restore_session() {
+    std::ifstream in(SESSION_FILE);
+    if (!in) {
+        return false;
+    }
+
+    int tiles = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string type;
+        fields >> type;
+        // Only apply complete lines, clamped to what the user could navigate to
+        if (type == "position") {
+            double latitude, longitude;
+            int zoom;
+            if (fields >> latitude >> longitude >> zoom && std::isfinite(latitude) && std::isfinite(longitude)) {
+                player_state.latitude = std::max(std::min(latitude, MAX_LATITUDE), MIN_LATITUDE);
+                player_state.longitude = std::max(std::min(longitude, 180.0), -180.0);
+                player_state.zoom = std::max(std::min(zoom, MAX_ZOOM), MIN_ZOOM);
+            }
+        } else if (type == "viewport") {
+            double angle_rotate, angle_tilt;
+            if (fields >> angle_rotate >> angle_tilt && std::isfinite(angle_rotate) && std::isfinite(angle_tilt)) {
+                viewport_state.angle_rotate = std::fmod(angle_rotate, 360.0);
+                viewport_state.angle_tilt = std::max(std::min(angle_tilt, (double) MAX_TILT), 0.0);
+            }
+        } else if (type == "tile") {
+            int zoom, x, y;
+            if (fields >> zoom >> x >> y && zoom >= MIN_ZOOM && zoom <= MAX_ZOOM
+                    && x >= 0 && x < (1 << zoom) && y >= 0 && y < (1 << zoom)) {
+                TileFactory::instance()->prefetch_tile(zoom, x, y);
+                tiles++;
+            }
+        }
+    }
+
+    std::cout << "Restored session with " << tiles << " tiles" << std::endl;
+    return true;
+}
@@ -0,0 +1,290 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/thread.hpp>
+
+#include "shmcache.h"
+
+/**
+ * @brief slot states, a zeroed slot is empty
+ */
+#define STATE_EMPTY (0)
+#define STATE_RESERVED (1)
+#define STATE_FETCHING (2)
+#define STATE_READY (3)
+
+ShmCache* ShmCache::_instance = nullptr;
+
+static uint64_t tile_key(int zoom, int x, int y) {
+    // the top bit keeps the key of tile 0/0/0 distinct from an unused slot
+    return (1ULL << 63) | ((uint64_t) zoom << 56) | ((uint64_t) x << 28) | (uint64_t) y;
+}
+
+static size_t key_slot(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key % SHM_SLOTS;
+}
+
+static bool process_alive(int32_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+ShmCache::ShmCache() {
+    size_t pixels_offset = (sizeof(s_header) + 4095) & ~(size_t) 4095;
+    size = pixels_offset + (size_t) SHM_SLOTS * SHM_SLOT_SIZE;
+
+    int fd = shm_open(SHM_NAME, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        std::cerr << "Shared tile cache unavailable: " << strerror(errno) << std::endl;
+        return;
+    }
+    // a new object is zero filled, which is an empty cache. The memory is
+    // reserved up front, writing to a sparse object beyond the size of the
+    // tmpfs would kill every process mapping it with SIGBUS.
+    int error = posix_fallocate(fd, 0, size);
+    if (error != 0) {
+        std::cerr << "Shared tile cache unavailable: " << strerror(error) << std::endl;
+        close(fd);
+        return;
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Shared tile cache unavailable: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    s_header* candidate = (s_header*) data;
+    uint32_t magic = 0;
+    candidate->magic.compare_exchange_strong(magic, SHM_MAGIC ^ SHM_VERSION);
+    if (candidate->magic != (SHM_MAGIC ^ SHM_VERSION)) {
+        std::cerr << "Shared tile cache " << SHM_NAME << " has an incompatible layout" << std::endl;
+        munmap(data, size);
+        return;
+    }
+    header = candidate;
+    pixels = (unsigned char*) data + pixels_offset;
+}
+
+ShmCache::~ShmCache() {
+    if (header != nullptr) {
+        munmap(header, size);
+    }
+}
+
+ShmCache::s_entry* ShmCache::find(uint64_t key, uint32_t state, int& slot) {
+    size_t start = key_slot(key);
+    for (size_t i = 0; i < SHM_PROBE; i++) {
+        size_t index = (start + i) % SHM_SLOTS;
+        s_entry& entry = header->entries[index];
+        // a slot is only (re)keyed while reserved, so check the state first
+        uint32_t current = entry.state;
+        if (current >= STATE_FETCHING && entry.key == key && (state == STATE_EMPTY || current == state)) {
+            slot = (int) index;
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool ShmCache::acquire(int zoom, int x, int y, s_shm_image& image) {
+    if (!valid()) {
+        return false;
+    }
+    uint64_t key = tile_key(zoom, x, y);
+    int slot;
+    s_entry* entry = find(key, STATE_READY, slot);
+    if (entry == nullptr) {
+        return false;
+    }
+    // take the reference before checking again, the evictor does it the
+    // other way round, so one of both sees the other
+    entry->refs++;
+    if (entry->state != STATE_READY || entry->key != key) {
+        entry->refs--;
+        return false;
+    }
+    entry->last_used = ++header->clock;
+    image.slot = slot;
+    image.pixels = pixels + (size_t) slot * SHM_SLOT_SIZE;
+    image.width = entry->width;
+    image.height = entry->height;
+    image.format = entry->format;
+    return true;
+}
+
+void ShmCache::release(s_shm_image& image) {
+    if (image.slot >= 0) {
+        header->entries[image.slot].refs--;
+        image.slot = -1;
+        image.pixels = nullptr;
+    }
+}
+
+int ShmCache::claim(int zoom, int x, int y, int& slot) {
+    if (!valid()) {
+        return SHM_FULL;
+    }
+    uint64_t key = tile_key(zoom, x, y);
+    int32_t pid = getpid();
+
+    if (find(key, STATE_READY, slot) != nullptr) {
+        return SHM_READY;
+    }
+
+    // Whoever swaps the key into the claim fetches the tile, everybody else waits for it
+    s_claim& claim = header->claims[key_slot(key)];
+    uint64_t claimed = 0;
+    if (claim.key.compare_exchange_strong(claimed, key)) {
+        claim.owner = pid;
+    } else if (claimed != key) {
+        // another tile with the same hash is fetched, fetch this one without sharing it
+        return SHM_FULL;
+    } else {
+        int32_t owner = claim.owner;
+        if (owner == 0 || process_alive(owner)) {
+            return SHM_BUSY;
+        }
+        // the owner died while fetching, take over its slot
+        if (!claim.owner.compare_exchange_strong(owner, pid)) {
+            return SHM_BUSY;
+        }
+        if (find(key, STATE_FETCHING, slot) != nullptr) {
+            return SHM_CLAIMED;
+        }
+    }
+
+    // The tile may have been published right before the key was claimed,
+    // publishing marks it ready before the claim is given up
+    if (find(key, STATE_READY, slot) != nullptr) {
+        unclaim(key);
+        return SHM_READY;
+    }
+
+    slot = reserve(key);
+    if (slot < 0) {
+        unclaim(key);
+        return SHM_FULL;
+    }
+    return SHM_CLAIMED;
+}
+
+int ShmCache::reserve(uint64_t key) {
+    size_t start = key_slot(key);
+    s_entry* victim = nullptr;
+    size_t victim_index = 0;
+    for (size_t i = 0; i < SHM_PROBE; i++) {
+        size_t index = (start + i) % SHM_SLOTS;
+        s_entry& candidate = header->entries[index];
+        uint32_t state = candidate.state;
+        if (state == STATE_EMPTY) {
+            if (candidate.state.compare_exchange_strong(state, STATE_RESERVED)) {
+                victim = &candidate;
+                victim_index = index;
+                break;
+            }
+        } else if (state == STATE_READY && candidate.refs == 0) {
+            if (victim == nullptr || candidate.last_used < victim->last_used) {
+                victim = &candidate;
+                victim_index = index;
+            }
+        }
+    }
+    if (victim == nullptr) {
+        return -1;
+    }
+    if (victim->state != STATE_RESERVED) {
+        uint32_t state = STATE_READY;
+        if (!victim->state.compare_exchange_strong(state, STATE_RESERVED)) {
+            return -1;
+        }
+        if (victim->refs != 0) {
+            // somebody acquired it in the meantime
+            victim->state = STATE_READY;
+            return -1;
+        }
+    }
+    // A reserved slot has no references, readers only reference ready slots
+    victim->key = key;
+    victim->state = STATE_FETCHING;
+    return (int) victim_index;
+}
+
+void ShmCache::unclaim(uint64_t key) {
+    s_claim& claim = header->claims[key_slot(key)];
+    claim.owner = 0;
+    claim.key = 0;
+}
+
+void ShmCache::publish(int slot, SDL_Surface* texture, GLenum texture_format) {
+    s_entry& entry = header->entries[slot];
+    size_t row = (size_t) texture->w * texture->format->BytesPerPixel;
+    if (row * texture->h > SHM_SLOT_SIZE) {
+        abandon(slot);
+        return;
+    }
+    unsigned char* target = pixels + (size_t) slot * SHM_SLOT_SIZE;
+    const unsigned char* source = (const unsigned char*) texture->pixels;
+    for (int y = 0; y < texture->h; y++) {
+        memcpy(target + y * row, source + y * texture->pitch, row);
+    }
+    entry.width = texture->w;
+    entry.height = texture->h;
+    entry.format = texture_format;
+    entry.last_used = ++header->clock;
+    entry.state = STATE_READY;
+    unclaim(entry.key);
+}
+
+void ShmCache::abandon(int slot) {
+    s_entry& entry = header->entries[slot];
+    uint64_t key = entry.key;
+    entry.state = STATE_EMPTY;
+    unclaim(key);
+}
+
+void ShmCache::wait(int zoom, int x, int y, int timeout) {
+    if (!valid()) {
+        return;
+    }
+    uint64_t key = tile_key(zoom, x, y);
+    s_claim& claim = header->claims[key_slot(key)];
+    for (int waited = 0; waited < timeout; waited += 10) {
+        int32_t owner = claim.owner;
+        if (claim.key != key || (owner != 0 && !process_alive(owner))) {
+            return;
+        }
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+}
@@ -0,0 +1,203 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_SHMCACHE_H_
+#define _SM3D_SHMCACHE_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include <GL/gl.h>
+#include <SDL2/SDL.h>
+
+/**
+ * @brief name of the shared memory object
+ */
+#define SHM_NAME "/slippymap3d-tiles"
+
+/**
+ * @brief magic number ("SM3S") and layout version of the shared memory object
+ */
+#define SHM_MAGIC (0x53334d53)
+#define SHM_VERSION (2)
+
+/**
+ * @brief number of decoded tiles held in shared memory
+ */
+#define SHM_SLOTS (1024)
+
+/**
+ * @brief maximum size of a decoded tile in bytes (256x256 RGBA)
+ */
+#define SHM_SLOT_SIZE (256 * 256 * 4)
+
+/**
+ * @brief number of slots searched for a tile, starting at the slot of its hash
+ */
+#define SHM_PROBE (32)
+
+/**
+ * @brief result of ShmCache::claim()
+ */
+enum {
+    /**
+     * @brief the tile is cached already
+     */
+    SHM_READY,
+    /**
+     * @brief the caller is responsible for fetching the tile and has to publish() or abandon() it
+     */
+    SHM_CLAIMED,
+    /**
+     * @brief another process or thread is fetching the tile
+     */
+    SHM_BUSY,
+    /**
+     * @brief the cache cannot take the tile right now
+     */
+    SHM_FULL
+};
+
+/**
+ * @brief a decoded tile within shared memory, valid until released
+ */
+struct s_shm_image {
+    int slot = -1;
+    const void* pixels = nullptr;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    GLenum format = 0;
+};
+
+/**
+ * @brief a cache of decoded tiles shared by all processes on the host
+ *
+ * The cache is a fixed array of slots in POSIX shared memory. A tile is
+ * found by probing the slots following the hash of its key, all state changes
+ * are atomic operations on the slot, so no process ever holds a lock. Slots are
+ * reference counted while in use and the least recently used unreferenced slot
+ * within the probe window is replaced. Fetching a tile is claimed with a single
+ * compare and swap on the claim of the slot of its hash, which records the pid
+ * of its owner. Other processes wait for the owner instead of fetching the same
+ * tile, and take over if the owner died.
+ */
+class ShmCache {
+public:
+    static ShmCache* instance() {
+        static CGuard g;
+        if (!_instance) {
+            _instance = new ShmCache();
+        }
+        return _instance;
+    }
+
+    /**
+     * @brief whether the shared memory is available
+     */
+    bool valid() {
+        return header != nullptr;
+    }
+    /**
+     * @brief get a cached tile, it must be released afterwards
+     * @return false, if the tile is not cached
+     */
+    bool acquire(int zoom, int x, int y, s_shm_image& image);
+    void release(s_shm_image& image);
+    /**
+     * @brief claim the right to fetch a tile
+     * @param slot receives the slot to publish to, if SHM_CLAIMED is returned
+     */
+    int claim(int zoom, int x, int y, int& slot);
+    /**
+     * @brief store a decoded tile in a claimed slot
+     */
+    void publish(int slot, SDL_Surface* texture, GLenum texture_format);
+    /**
+     * @brief give up a claimed slot, e.g. if the download failed
+     */
+    void abandon(int slot);
+    /**
+     * @brief wait until no other process fetches the tile anymore
+     * @param timeout maximum time to wait in milliseconds
+     */
+    void wait(int zoom, int x, int y, int timeout);
+private:
+    struct s_entry {
+        std::atomic<uint64_t> key;
+        std::atomic<uint32_t> state;
+        std::atomic<int32_t> refs;
+        std::atomic<uint64_t> last_used;
+        uint32_t width;
+        uint32_t height;
+        uint32_t format;
+    };
+
+    /**
+     * @brief the tile fetched for the keys hashing to a slot, a zero key if none
+     */
+    struct s_claim {
+        std::atomic<uint64_t> key;
+        /**
+         * @brief pid of the fetching process, 0 right after the key was claimed
+         */
+        std::atomic<int32_t> owner;
+    };
+
+    struct s_header {
+        std::atomic<uint32_t> magic;
+        std::atomic<uint64_t> clock;
+        s_entry entries[SHM_SLOTS];
+        s_claim claims[SHM_SLOTS];
+    };
+
+    static ShmCache* _instance;
+    s_header* header = nullptr;
+    unsigned char* pixels = nullptr;
+    size_t size = 0;
+
+    ShmCache();
+    ShmCache(const ShmCache&) {}
+    ~ShmCache();
+
+    s_entry* find(uint64_t key, uint32_t state, int& slot);
+    /**
+     * @brief reserve an empty slot or the least recently used unreferenced one
+     * @return the slot, or -1 if all slots of the probe window are in use
+     */
+    int reserve(uint64_t key);
+    void unclaim(uint64_t key);
+
+    class CGuard {
+    public:
+        ~CGuard() {
+            if (ShmCache::_instance != nullptr) {
+                delete ShmCache::_instance;
+                ShmCache::_instance = nullptr;
+            }
+        }
+    };
+    friend class CGuard;
+};
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <SDL2/SDL_image.h>
+#include <boost/bind/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "terrain.h"
+#include "loader.h"
+#include "global.h"
+
+/**
+ * @brief circumference of the earth at the equator in meters
+ */
+#define EARTH_CIRCUMFERENCE (40075016.686)
+
+struct s_terrain_config terrain_config;
+
+Terrain* Terrain::_instance = nullptr;
+
+static uint64_t tile_key(int zoom, int x, int y) {
+    return ((uint64_t) zoom << 56) | ((uint64_t) x << 28) | (uint64_t) y;
+}
+
+Terrain::~Terrain() {
+    // The loader is destroyed first, meshes it did not build any more are left alone
+    for (std::pair<const uint64_t, s_terrain_mesh*>& mesh : meshes) {
+        if (mesh.second->ready) {
+            delete mesh.second;
+        }
+    }
+    meshes.clear();
+}
+
+std::shared_ptr<Terrain::s_grid> Terrain::get_grid(Tile* elevation) {
+    uint64_t key = tile_key(elevation->zoom, elevation->x, elevation->y);
+    {
+        boost::lock_guard<boost::mutex> lock(grids_mutex);
+        std::unordered_map<uint64_t, std::shared_ptr<s_grid> >::iterator grid = grids.find(key);
+        if (grid != grids.end()) {
+            grid->second->last_used = ++grids_used;
+            return grid->second;
+        }
+    }
+
+    std::string filename = TILE_DIR + elevation->get_filename();
+    SDL_Surface* image = IMG_Load(filename.c_str());
+    if (!image) {
+        std::cerr << "Failed to load elevation tile " << filename << std::endl;
+        return std::shared_ptr<s_grid>();
+    }
+    SDL_Surface* rgb = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_RGB24, 0);
+    SDL_FreeSurface(image);
+    if (!rgb) {
+        return std::shared_ptr<s_grid>();
+    }
+
+    // Terrarium encodes the height as (red * 256 + green + blue / 256) - 32768 meters
+    std::shared_ptr<s_grid> grid(new s_grid());
+    grid->width = rgb->w;
+    grid->height = rgb->h;
+    grid->heights.resize(rgb->w * rgb->h);
+    if (SDL_MUSTLOCK(rgb)) {
+        SDL_LockSurface(rgb);
+    }
+    for (int y = 0; y < rgb->h; y++) {
+        const unsigned char* row = (const unsigned char*) rgb->pixels + y * rgb->pitch;
+        for (int x = 0; x < rgb->w; x++) {
+            grid->heights[y * rgb->w + x] = (row[x * 3] * 256.0f + row[x * 3 + 1] + row[x * 3 + 2] / 256.0f) - 32768.0f;
+        }
+    }
+    if (SDL_MUSTLOCK(rgb)) {
+        SDL_UnlockSurface(rgb);
+    }
+    SDL_FreeSurface(rgb);
+
+    boost::lock_guard<boost::mutex> lock(grids_mutex);
+    grid->last_used = ++grids_used;
+    grids[key] = grid;
+    if (grids.size() > TERRAIN_GRID_CACHE) {
+        std::unordered_map<uint64_t, std::shared_ptr<s_grid> >::iterator oldest = grids.begin();
+        for (std::unordered_map<uint64_t, std::shared_ptr<s_grid> >::iterator it = grids.begin(); it != grids.end(); ++it) {
+            if (it->second->last_used < oldest->second->last_used) {
+                oldest = it;
+            }
+        }
+        grids.erase(oldest);
+    }
+    return grid;
+}
+
+void Terrain::build(Tile* elevation, int zoom, int x, int y, s_terrain_mesh* mesh) {
+    std::shared_ptr<s_grid> grid = get_grid(elevation);
+    if (!grid) {
+        mesh->missing = !boost::filesystem::exists(TILE_DIR + elevation->get_filename());
+        mesh->ready = true;
+        return;
+    }
+
+    // Position of the map tile within the (possibly larger) elevation tile
+    int shift = zoom - elevation->zoom;
+    double scale = 1.0 / (1 << shift);
+    double offset_x = (x - (elevation->x << shift)) * scale;
+    double offset_y = (y - (elevation->y << shift)) * scale;
+
+    // Sample the heights at full resolution first
+    const int size = 1 << (TERRAIN_LEVELS - 1);
+    std::vector<float> heights((size + 1) * (size + 1));
+    for (int j = 0; j <= size; j++) {
+        double py = std::max(0.0, std::min((offset_y + scale * j / size) * grid->height - 0.5, grid->height - 1.0));
+        int y0 = std::min((int) py, grid->height - 2);
+        double fy = py - y0;
+        for (int i = 0; i <= size; i++) {
+            double px = std::max(0.0, std::min((offset_x + scale * i / size) * grid->width - 0.5, grid->width - 1.0));
+            int x0 = std::min((int) px, grid->width - 2);
+            double fx = px - x0;
+            const float* row0 = &grid->heights[y0 * grid->width + x0];
+            const float* row1 = row0 + grid->width;
+            heights[j * (size + 1) + i] = (row0[0] * (1 - fx) + row0[1] * fx) * (1 - fy) + (row1[0] * (1 - fx) + row1[1] * fx) * fy;
+        }
+    }
+
+    for (int level = 0; level < TERRAIN_LEVELS; level++) {
+        int step = 1 << level;
+        int n = size >> level;
+
+        // The error of a level is the largest difference to the full resolution heights
+        float error = 0.0f;
+        for (int j = 0; j <= size; j++) {
+            int cy = std::min(j / step, n - 1);
+            float fy = (float) (j - cy * step) / step;
+            for (int i = 0; i <= size; i++) {
+                int cx = std::min(i / step, n - 1);
+                float fx = (float) (i - cx * step) / step;
+                const float* row0 = &heights[cy * step * (size + 1) + cx * step];
+                const float* row1 = row0 + step * (size + 1);
+                float interpolated = (row0[0] * (1 - fx) + row0[step] * fx) * (1 - fy) + (row1[0] * (1 - fx) + row1[step] * fx) * fy;
+                error = std::max(error, std::abs(interpolated - heights[j * (size + 1) + i]));
+            }
+        }
+
+        GLuint base = mesh->vertices.size() / 5;
+        for (int j = 0; j <= n; j++) {
+            for (int i = 0; i <= n; i++) {
+                mesh->vertices.push_back(-TILE_SIZE + 2 * TILE_SIZE * i / n);
+                mesh->vertices.push_back(-TILE_SIZE + 2 * TILE_SIZE * j / n);
+                mesh->vertices.push_back(heights[j * step * (size + 1) + i * step]);
+                mesh->vertices.push_back((float) i / n);
+                mesh->vertices.push_back((float) j / n);
+            }
+        }
+
+        mesh->levels[level].first = mesh->indices.size();
+        mesh->levels[level].error = error;
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                GLuint a = base + j * (n + 1) + i;
+                GLuint b = a + 1;
+                GLuint c = a + (n + 1);
+                GLuint d = c + 1;
+                mesh->indices.insert(mesh->indices.end(), { a, b, c, b, d, c });
+            }
+        }
+
+        // Hang a skirt below the edges, it hides the cracks towards neighbours using a different
+        // level of detail
+        float skirt = 2 * error + 10.0f;
+        for (int edge = 0; edge < 4; edge++) {
+            GLuint previous = 0;
+            GLuint previous_skirt = 0;
+            for (int k = 0; k <= n; k++) {
+                int i = edge == 0 ? k : edge == 1 ? n : edge == 2 ? n - k : 0;
+                int j = edge == 0 ? 0 : edge == 1 ? k : edge == 2 ? n : n - k;
+                GLuint vertex = base + j * (n + 1) + i;
+                GLuint vertex_skirt = mesh->vertices.size() / 5;
+                for (int c = 0; c < 5; c++) {
+                    GLfloat value = mesh->vertices[vertex * 5 + c];
+                    mesh->vertices.push_back(c == 2 ? value - skirt : value);
+                }
+                if (k > 0) {
+                    mesh->indices.insert(mesh->indices.end(), { previous, vertex, previous_skirt, vertex, vertex_skirt, previous_skirt });
+                }
+                previous = vertex;
+                previous_skirt = vertex_skirt;
+            }
+        }
+        mesh->levels[level].count = mesh->indices.size() - mesh->levels[level].first;
+    }
+
+    mesh->heights.swap(heights);
+    mesh->ready = true;
+}
+
+void Terrain::set_reference(int zoom, double latitude, double longitude) {
+    if (!terrain_config.enabled) {
+        return;
+    }
+    double tile_x = long2tilexf(longitude, zoom);
+    double tile_y = lat2tileyf(latitude, zoom);
+    std::unordered_map<uint64_t, s_terrain_mesh*>::iterator found = meshes.find(tile_key(zoom, (int) floor(tile_x), (int) floor(tile_y)));
+    // Keep the previous reference until the mesh below the position is built
+    if (found == meshes.end() || !found->second->ready || found->second->heights.empty()) {
+        return;
+    }
+
+    const int size = 1 << (TERRAIN_LEVELS - 1);
+    const std::vector<float>& heights = found->second->heights;
+    double px = (tile_x - floor(tile_x)) * size;
+    double py = (tile_y - floor(tile_y)) * size;
+    int x0 = std::min((int) px, size - 1);
+    int y0 = std::min((int) py, size - 1);
+    double fx = px - x0;
+    double fy = py - y0;
+    const float* row0 = &heights[y0 * (size + 1) + x0];
+    const float* row1 = row0 + (size + 1);
+    reference = (row0[0] * (1 - fx) + row0[1] * fx) * (1 - fy) + (row1[0] * (1 - fx) + row1[1] * fx) * fy;
+}
+
+void Terrain::evict() {
+    if (meshes.size() <= TERRAIN_CACHE) {
+        return;
+    }
+    std::unordered_map<uint64_t, s_terrain_mesh*>::iterator oldest = meshes.end();
+    for (std::unordered_map<uint64_t, s_terrain_mesh*>::iterator it = meshes.begin(); it != meshes.end(); ++it) {
+        if (it->second->ready && (oldest == meshes.end() || it->second->last_used < oldest->second->last_used)) {
+            oldest = it;
+        }
+    }
+    if (oldest == meshes.end()) {
+        return;
+    }
+    if (oldest->second->vbo != 0) {
+        glDeleteBuffers(1, &oldest->second->vbo);
+        glDeleteBuffers(1, &oldest->second->ibo);
+    }
+    delete oldest->second;
+    meshes.erase(oldest);
+}
+
+bool Terrain::draw_tile(Tile* tile, double angle_tilt) {
+    if (!terrain_config.enabled) {
+        return false;
+    }
+
+    uint64_t key = tile_key(tile->zoom, tile->x, tile->y);
+    std::unordered_map<uint64_t, s_terrain_mesh*>::iterator found = meshes.find(key);
+    if (found == meshes.end()) {
+        // Elevation tiles are not available for the highest zoom levels, use a part of a coarser one
+        int elevation_zoom = std::min(tile->zoom, elevation_source.max_zoom);
+        int shift = tile->zoom - elevation_zoom;
+        Tile* elevation = TileFactory::instance()->get_tile(&elevation_source, elevation_zoom, tile->x >> shift, tile->y >> shift);
+        if (elevation->texid != 0) {
+            return false;
+        }
+        s_terrain_mesh* mesh = new s_terrain_mesh();
+        meshes[key] = mesh;
+        Loader::instance()->post(boost::bind(&Terrain::build, this, elevation, tile->zoom, tile->x, tile->y, mesh));
+        evict();
+        return false;
+    }
+
+    s_terrain_mesh* mesh = found->second;
+
+    // The elevation tile was evicted meanwhile, fetch it again and build the mesh once it is back
+    if (mesh->ready && mesh->missing) {
+        int elevation_zoom = std::min(tile->zoom, elevation_source.max_zoom);
+        int shift = tile->zoom - elevation_zoom;
+        Tile* elevation = TileFactory::instance()->get_tile(&elevation_source, elevation_zoom, tile->x >> shift, tile->y >> shift);
+        if (elevation->texid == 0) {
+            elevation->texid = TileFactory::instance()->get_dummy();
+            Loader::instance()->load_image(*elevation);
+        }
+        delete mesh;
+        meshes.erase(found);
+        return false;
+    }
+
+    if (!mesh->ready || (mesh->vbo == 0 && mesh->indices.empty())) {
+        return false;
+    }
+    mesh->last_used = tile->last_used;
+
+    // Move the finished mesh to the GPU once
+    if (mesh->vbo == 0) {
+        glGenBuffers(1, &mesh->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+        glBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(GLfloat), mesh->vertices.data(), GL_STATIC_DRAW);
+        glGenBuffers(1, &mesh->ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->indices.size() * sizeof(GLuint), mesh->indices.data(), GL_STATIC_DRAW);
+        std::vector<GLfloat>().swap(mesh->vertices);
+        std::vector<GLuint>().swap(mesh->indices);
+    }
+
+    // With the orthographic projection the screen-space error of a height only depends on the
+    // tilt, use the coarsest level of detail staying below the allowed error
+    double latitude = (tiley2lat(tile->y, tile->zoom) + tiley2lat(tile->y + 1, tile->zoom)) / 2;
+    double pixels_per_meter = 2 * TILE_SIZE * pow(2.0, tile->zoom) / (EARTH_CIRCUMFERENCE * cos(latitude * M_PI / 180));
+    double height_scale = pixels_per_meter * terrain_config.exaggeration;
+    double error_scale = height_scale * sin(angle_tilt * M_PI / 180);
+    int level = 0;
+    while (level + 1 < TERRAIN_LEVELS && mesh->levels[level + 1].error * error_scale <= TERRAIN_MAX_ERROR) {
+        level++;
+    }
+
+    glPushMatrix();
+        glScaled(1.0, 1.0, height_scale);
+        glTranslated(0.0, 0.0, -reference);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 5 * sizeof(GLfloat), nullptr);
+        glTexCoordPointer(2, GL_FLOAT, 5 * sizeof(GLfloat), (const GLvoid*) (3 * sizeof(GLfloat)));
+        glDrawElements(GL_TRIANGLES, mesh->levels[level].count, GL_UNSIGNED_INT, (const GLvoid*) (mesh->levels[level].first * sizeof(GLuint)));
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glPopMatrix();
+
+    return true;
+}
@@ -0,0 +1,182 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_TERRAIN_H_
+#define _SM3D_TERRAIN_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include <GL/gl.h>
+
+#include "tile.h"
+
+/**
+ * @brief the number of levels of detail of a terrain mesh
+ *
+ * The finest level has 2^(TERRAIN_LEVELS - 1) quads along each edge, every
+ * coarser one half as many.
+ */
+#define TERRAIN_LEVELS (7)
+
+/**
+ * @brief the maximum error of the terrain on screen in pixels
+ */
+#define TERRAIN_MAX_ERROR (1.0)
+
+/**
+ * @brief the number of terrain meshes kept in memory
+ */
+#define TERRAIN_CACHE (512)
+
+/**
+ * @brief the number of decoded elevation tiles kept in memory
+ */
+#define TERRAIN_GRID_CACHE (64)
+
+/**
+ * @brief holds the configuration of the terrain
+ */
+struct s_terrain_config {
+    bool enabled = false;
+    /**
+     * @brief factor applied to the heights
+     */
+    double exaggeration = 1.0;
+};
+
+extern struct s_terrain_config terrain_config;
+
+/**
+ * @brief the level of detail within a terrain mesh
+ */
+struct s_terrain_level {
+    /**
+     * @brief offset of the level within the index buffer
+     */
+    GLsizei first;
+    GLsizei count;
+    /**
+     * @brief maximum difference to the full resolution heights in meters
+     */
+    float error;
+};
+
+/**
+ * @brief the terrain below a single map tile, in all levels of detail
+ */
+struct s_terrain_mesh {
+    std::atomic<bool> ready;
+    /**
+     * @brief the elevation tile was evicted before the mesh was built, it is downloaded again
+     */
+    bool missing = false;
+    GLuint vbo = 0;
+    GLuint ibo = 0;
+    /**
+     * @brief interleaved x, y, height (in meters), u and v per vertex
+     */
+    std::vector<GLfloat> vertices;
+    std::vector<GLuint> indices;
+    /**
+     * @brief the heights of the finest level in meters, row by row
+     */
+    std::vector<float> heights;
+    s_terrain_level levels[TERRAIN_LEVELS];
+    unsigned int last_used = 0;
+    s_terrain_mesh() : ready(false) {}
+};
+
+/**
+ * @brief drapes the map tiles over meshes built from elevation tiles
+ *
+ * Elevation tiles are fetched through the TileFactory and the Loader like the
+ * map tiles. Decoding them and building the meshes happens on the loader
+ * threads, the render thread only uploads finished meshes into vertex buffers.
+ */
+class Terrain {
+public:
+    static Terrain* instance() {
+        static CGuard g;
+        if (!_instance) {
+            _instance = new Terrain();
+        }
+        return _instance;
+    }
+
+    /**
+     * @brief draw a map tile, with its texture bound, centered at the origin
+     * @return false, if the terrain is not available (yet) and the tile needs to be drawn flat
+     */
+    bool draw_tile(Tile* tile, double angle_tilt);
+    /**
+     * @brief use the height at the given position as the base of the terrain
+     *
+     * The terrain is drawn relative to this height, so around the position it
+     * lines up with the overlays and with the tiles still drawn flat.
+     */
+    void set_reference(int zoom, double latitude, double longitude);
+private:
+    static Terrain* _instance;
+    /**
+     * @brief the height drawn at zero in meters
+     */
+    double reference = 0.0;
+    std::unordered_map<uint64_t, s_terrain_mesh*> meshes;
+
+    struct s_grid {
+        int width;
+        int height;
+        std::vector<float> heights;
+        unsigned int last_used;
+    };
+    boost::mutex grids_mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<s_grid> > grids;
+    unsigned int grids_used = 0;
+
+    Terrain() {}
+    Terrain(const Terrain&) {}
+    ~Terrain();
+
+    std::shared_ptr<s_grid> get_grid(Tile* elevation);
+    void build(Tile* elevation, int zoom, int x, int y, s_terrain_mesh* mesh);
+    void evict();
+
+    class CGuard {
+    public:
+        ~CGuard() {
+            if (Terrain::_instance != nullptr) {
+                delete Terrain::_instance;
+                Terrain::_instance = nullptr;
+            }
+        }
+    };
+    friend class CGuard;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+
+#include "tessellate.h"
+
+// The implementation follows the approach of mapbox's earcut: the rings are kept in doubly
+// linked lists, holes are merged into the outer ring through bridges and ears are cut until
+// a single triangle remains.
+
+namespace {
+
+struct s_node {
+    unsigned int i;
+    double x;
+    double y;
+    s_node* prev;
+    s_node* next;
+};
+
+class Nodes {
+public:
+    s_node* insert(unsigned int i, double x, double y, s_node* last) {
+        nodes.push_back({ i, x, y, nullptr, nullptr });
+        s_node* node = &nodes.back();
+        if (last == nullptr) {
+            node->prev = node;
+            node->next = node;
+        } else {
+            node->next = last->next;
+            node->prev = last;
+            last->next->prev = node;
+            last->next = node;
+        }
+        return node;
+    }
+    s_node* copy(s_node* node) {
+        nodes.push_back({ node->i, node->x, node->y, nullptr, nullptr });
+        return &nodes.back();
+    }
+private:
+    std::deque<s_node> nodes;
+};
+
+double signed_area(const ring_t& ring) {
+    double sum = 0.0;
+    for (size_t i = 0, j = ring.size() - 2; i < ring.size(); i += 2) {
+        sum += (ring[j] - ring[i]) * (ring[i + 1] + ring[j + 1]);
+        j = i;
+    }
+    return sum;
+}
+
+double area(const s_node* p, const s_node* q, const s_node* r) {
+    return (q->y - p->y) * (r->x - q->x) - (q->x - p->x) * (r->y - q->y);
+}
+
+bool equals(const s_node* a, const s_node* b) {
+    return a->x == b->x && a->y == b->y;
+}
+
+bool point_in_triangle(double ax, double ay, double bx, double by, double cx, double cy, double px, double py) {
+    return (cx - px) * (ay - py) >= (ax - px) * (cy - py) &&
+           (ax - px) * (by - py) >= (bx - px) * (ay - py) &&
+           (bx - px) * (cy - py) >= (cx - px) * (by - py);
+}
+
+bool locally_inside(const s_node* a, const s_node* b) {
+    return area(a->prev, a, a->next) < 0 ?
+        area(a, b, a->next) >= 0 && area(a, a->prev, b) >= 0 :
+        area(a, b, a->prev) < 0 || area(a, a->next, b) < 0;
+}
+
+void remove_node(s_node* p) {
+    p->next->prev = p->prev;
+    p->prev->next = p->next;
+}
+
+/**
+ * @brief link a ring, in clockwise or counter-clockwise order
+ */
+s_node* linked_list(Nodes& nodes, const ring_t& ring, unsigned int offset, bool clockwise) {
+    s_node* last = nullptr;
+    unsigned int count = ring.size() / 2;
+    if (clockwise == (signed_area(ring) > 0)) {
+        for (unsigned int i = 0; i < count; i++) {
+            last = nodes.insert(offset + i, ring[i * 2], ring[i * 2 + 1], last);
+        }
+    } else {
+        for (unsigned int i = count; i-- > 0;) {
+            last = nodes.insert(offset + i, ring[i * 2], ring[i * 2 + 1], last);
+        }
+    }
+    if (last != nullptr && last != last->next && equals(last, last->next)) {
+        s_node* next = last->next;
+        remove_node(last);
+        last = next;
+    }
+    return last;
+}
+
+/**
+ * @brief remove duplicate and collinear points
+ */
+s_node* filter_points(s_node* start, s_node* end = nullptr) {
+    if (end == nullptr) {
+        end = start;
+    }
+    s_node* p = start;
+    bool again;
+    do {
+        again = false;
+        if (equals(p, p->next) || area(p->prev, p, p->next) == 0) {
+            remove_node(p);
+            p = end = p->prev;
+            if (p == p->next) {
+                break;
+            }
+            again = true;
+        } else {
+            p = p->next;
+        }
+    } while (again || p != end);
+    return end;
+}
+
+bool is_ear(const s_node* ear) {
+    const s_node* a = ear->prev;
+    const s_node* b = ear;
+    const s_node* c = ear->next;
+    if (area(a, b, c) >= 0) {
+        return false;
+    }
+    for (const s_node* p = c->next; p != a; p = p->next) {
+        if (point_in_triangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y) && area(p->prev, p, p->next) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void cut_ears(s_node* ear, std::vector<unsigned int>& triangles) {
+    bool filtered = false;
+    s_node* stop = ear;
+    while (ear->prev != ear->next) {
+        s_node* prev = ear->prev;
+        s_node* next = ear->next;
+        if (is_ear(ear)) {
+            triangles.push_back(prev->i);
+            triangles.push_back(ear->i);
+            triangles.push_back(next->i);
+            remove_node(ear);
+            ear = next->next;
+            stop = next->next;
+            continue;
+        }
+        ear = next;
+        if (ear == stop) {
+            // Give up on rings which still have no ear after removing degenerate points
+            if (filtered) {
+                break;
+            }
+            ear = stop = filter_points(ear);
+            filtered = true;
+        }
+    }
+}
+
+s_node* leftmost(s_node* start) {
+    s_node* p = start;
+    s_node* result = start;
+    do {
+        if (p->x < result->x || (p->x == result->x && p->y < result->y)) {
+            result = p;
+        }
+        p = p->next;
+    } while (p != start);
+    return result;
+}
+
+/**
+ * @brief find a vertex of the outer ring visible from the leftmost point of a hole
+ */
+s_node* find_bridge(s_node* hole, s_node* outer) {
+    s_node* p = outer;
+    double hx = hole->x;
+    double hy = hole->y;
+    double qx = -std::numeric_limits<double>::infinity();
+    s_node* m = nullptr;
+
+    // Cast a ray to the left and find the closest edge of the outer ring
+    do {
+        if (hy <= p->y && hy >= p->next->y && p->next->y != p->y) {
+            double x = p->x + (hy - p->y) * (p->next->x - p->x) / (p->next->y - p->y);
+            if (x <= hx && x > qx) {
+                qx = x;
+                m = p->x < p->next->x ? p : p->next;
+                if (x == hx) {
+                    return m;
+                }
+            }
+        }
+        p = p->next;
+    } while (p != outer);
+    if (m == nullptr) {
+        return nullptr;
+    }
+
+    // Vertices within the triangle of the hole point, the intersection and the edge's end
+    // point could block the view, prefer the one with the smallest angle then
+    s_node* stop = m;
+    double mx = m->x;
+    double my = m->y;
+    double tan_min = std::numeric_limits<double>::infinity();
+    p = m;
+    do {
+        if (hx >= p->x && p->x >= mx && hx != p->x &&
+                point_in_triangle(hy < my ? hx : qx, hy, mx, my, hy < my ? qx : hx, hy, p->x, p->y)) {
+            double tan = std::abs(hy - p->y) / (hx - p->x);
+            if (locally_inside(p, hole) && (tan < tan_min || (tan == tan_min && p->x > m->x))) {
+                m = p;
+                tan_min = tan;
+            }
+        }
+        p = p->next;
+    } while (p != stop);
+    return m;
+}
+
+/**
+ * @brief connect two vertices by a pair of edges, duplicating both
+ */
+s_node* split_polygon(Nodes& nodes, s_node* a, s_node* b) {
+    s_node* a2 = nodes.copy(a);
+    s_node* b2 = nodes.copy(b);
+    s_node* an = a->next;
+    s_node* bp = b->prev;
+    a->next = b;
+    b->prev = a;
+    a2->next = an;
+    an->prev = a2;
+    b2->next = a2;
+    a2->prev = b2;
+    bp->next = b2;
+    b2->prev = bp;
+    return b2;
+}
+
+}
+
+void tessellate(const std::vector<ring_t>& rings, std::vector<unsigned int>& triangles) {
+    if (rings.empty() || rings[0].size() < 6) {
+        return;
+    }
+
+    Nodes nodes;
+    unsigned int offset = rings[0].size() / 2;
+    s_node* outer = linked_list(nodes, rings[0], 0, true);
+    if (outer == nullptr || outer->next == outer->prev) {
+        return;
+    }
+
+    std::vector<s_node*> holes;
+    for (size_t i = 1; i < rings.size(); i++) {
+        if (rings[i].size() >= 6) {
+            s_node* hole = linked_list(nodes, rings[i], offset, false);
+            if (hole != nullptr) {
+                holes.push_back(leftmost(hole));
+            }
+        }
+        offset += rings[i].size() / 2;
+    }
+
+    // Merge the holes from left to right, so bridges do not cross each other
+    std::sort(holes.begin(), holes.end(), [](const s_node* a, const s_node* b) {
+        return a->x < b->x;
+    });
+    for (s_node* hole : holes) {
+        s_node* bridge = find_bridge(hole, outer);
+        if (bridge == nullptr) {
+            continue;
+        }
+        s_node* reverse = split_polygon(nodes, bridge, hole);
+        filter_points(reverse, reverse->next);
+        outer = filter_points(bridge, bridge->next);
+    }
+
+    cut_ears(outer, triangles);
+}
@@ -0,0 +1,45 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_TESSELLATE_H_
+#define _SM3D_TESSELLATE_H_
+
+#include <vector>
+
+/**
+ * @brief a closed ring of a polygon as x, y pairs
+ */
+typedef std::vector<double> ring_t;
+
+/**
+ * @brief triangulate a polygon with holes by ear clipping
+ *
+ * Holes are joined into the outer ring by bridges first. The resulting indices
+ * refer to the vertices of all rings, numbered consecutively in order.
+ * @param rings the outer ring followed by its holes, in any orientation
+ * @param triangles receives three indices per triangle
+ */
+extern void tessellate(const std::vector<ring_t>& rings, std::vector<unsigned int>& triangles);
+
+#endif
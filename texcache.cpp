@@ -0,0 +1,143 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+
+#include "texcache.h"
+
+MappedTexture::MappedTexture(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(s_texcache_header)) {
+        close(fd);
+        return;
+    }
+    size = st.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        data = nullptr;
+        return;
+    }
+
+    const s_texcache_header* candidate = (const s_texcache_header*) data;
+    if (candidate->magic != TEXCACHE_MAGIC || candidate->version != TEXCACHE_VERSION) {
+        return;
+    }
+    // The upload reads width * height pixels of the stated format, they have to agree
+    bool rgb = candidate->format == GL_RGB || candidate->format == GL_BGR;
+    bool rgba = candidate->format == GL_RGBA || candidate->format == GL_BGRA;
+    if (!(rgb && candidate->bytes_per_pixel == 3) && !(rgba && candidate->bytes_per_pixel == 4)) {
+        return;
+    }
+    // A truncated file (e.g. after running out of disk space) is treated as missing
+    size_t expected = sizeof(s_texcache_header) + (size_t) candidate->width * candidate->height * candidate->bytes_per_pixel;
+    if (size != expected) {
+        return;
+    }
+    header = candidate;
+}
+
+MappedTexture::~MappedTexture() {
+    if (data != nullptr) {
+        munmap(data, size);
+    }
+}
+
+GLuint MappedTexture::upload() {
+    if (!valid()) {
+        return 0;
+    }
+
+    GLuint texid;
+    glGenTextures(1, &texid);
+    glBindTexture(GL_TEXTURE_2D, texid);
+
+    // Rows are stored without padding
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, 3, header->width, header->height, 0, header->format, GL_UNSIGNED_BYTE, header + 1);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    return texid;
+}
+
+void MappedTexture::prefault() {
+    if (data == nullptr) {
+        return;
+    }
+    madvise(data, size, MADV_WILLNEED);
+    long page = sysconf(_SC_PAGESIZE);
+    volatile unsigned char sum = 0;
+    for (size_t offset = 0; offset < size; offset += page) {
+        sum += ((const unsigned char*) data)[offset];
+    }
+}
+
+bool texcache_write(const std::string& filename, SDL_Surface* surface, GLenum format) {
+    s_texcache_header header;
+    header.magic = TEXCACHE_MAGIC;
+    header.version = TEXCACHE_VERSION;
+    header.width = surface->w;
+    header.height = surface->h;
+    header.format = format;
+    header.bytes_per_pixel = surface->format->BytesPerPixel;
+
+    // Write to a temporary file first, so a reader never maps a partial tile
+    boost::filesystem::path target(filename);
+    boost::filesystem::path tmp = target.parent_path() / boost::filesystem::unique_path(".%%%%-%%%%.tex");
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    size_t row = (size_t) surface->w * header.bytes_per_pixel;
+    for (int y = 0; ok && y < surface->h; y++) {
+        ok = fwrite((unsigned char*) surface->pixels + (size_t) y * surface->pitch, row, 1, fp) == 1;
+    }
+    ok = (fclose(fp) == 0) && ok;
+
+    boost::system::error_code ec;
+    if (ok) {
+        boost::filesystem::rename(tmp, target, ec);
+        ok = !ec;
+    }
+    if (!ok) {
+        std::cerr << "Failed to write transcoded tile " << filename << std::endl;
+        boost::filesystem::remove(tmp, ec);
+    }
+    return ok;
+}
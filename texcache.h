@@ -0,0 +1,109 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_TEXCACHE_H_
+#define _SM3D_TEXCACHE_H_
+
+#include <string>
+#include <cstdint>
+
+#include <GL/gl.h>
+#include <SDL2/SDL.h>
+
+/**
+ * @brief magic number ("SM3T") at the start of every transcoded tile
+ */
+#define TEXCACHE_MAGIC (0x54334d53)
+
+/**
+ * @brief version of the transcoded tile layout, bump on incompatible changes
+ */
+#define TEXCACHE_VERSION (1)
+
+/**
+ * @brief header in front of the pixel data of a transcoded tile
+ */
+struct s_texcache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    /**
+     * @brief the OpenGL pixel format of the data (e.g. GL_RGB or GL_BGRA)
+     */
+    uint32_t format;
+    uint32_t bytes_per_pixel;
+};
+
+/**
+ * @brief a transcoded tile mapped read-only into memory
+ */
+class MappedTexture {
+public:
+    MappedTexture(const std::string& filename);
+    ~MappedTexture();
+    /**
+     * @brief check if the file exists and has a complete, known layout
+     */
+    bool valid() {
+        return header != nullptr;
+    }
+    /**
+     * @brief upload the mapped pixels into a new texture
+     * @return the texture id or 0 if the mapping is not valid
+     */
+    GLuint upload();
+    /**
+     * @brief read the mapped file, so a later upload does not wait for the disk
+     */
+    void prefault();
+    /**
+     * @brief the header of the mapped tile, nullptr if the mapping is not valid
+     */
+    const s_texcache_header* get_header() {
+        return header;
+    }
+    /**
+     * @brief the tightly packed pixels following the header
+     */
+    const void* get_pixels() {
+        return header + 1;
+    }
+private:
+    void* data = nullptr;
+    size_t size = 0;
+    const s_texcache_header* header = nullptr;
+    MappedTexture(const MappedTexture&) {}
+};
+
+/**
+ * @brief write the pixels of a surface as transcoded tile
+ * @param filename the target file, replaced atomically
+ * @param surface the surface to store, tightly packed
+ * @param format the OpenGL pixel format matching the surface
+ * @return true if the file was written
+ */
+extern bool texcache_write(const std::string& filename, SDL_Surface* surface, GLenum format);
+
+#endif
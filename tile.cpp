@@ -24,15 +24,22 @@
 
 #include <sstream>
 #include <cmath>
+#include <algorithm>
 
 #include "tile.h"
 #include "loader.h"
 
-Tile::Tile(int zoom, int x, int y, GLuint texid) : zoom(zoom), x(x), y(y), texid(texid) {
+s_tile_source map_source = { "", "http://localhost/osm_tiles/", ".png", 18, true };
+
+s_tile_source elevation_source = { "terrarium/", "http://s3.amazonaws.com/elevation-tiles-prod/terrarium/", ".png", 15, false };
+
+s_tile_source vector_source = { "vector/", "http://localhost/vector_tiles/", ".pbf", 14, false };
+
+Tile::Tile(int zoom, int x, int y, GLuint texid, s_tile_source* source) : zoom(zoom), x(x), y(y), texid(texid), last_used(0), source(source) {
 }
 
 Tile* Tile::get(int x_diff, int y_diff) {
-    return TileFactory::instance()->get_tile(zoom, x+x_diff, y+y_diff);
+    return TileFactory::instance()->get_tile(source, zoom, x+x_diff, y+y_diff);
 }
 
 Tile* Tile::get_east() {
@@ -53,10 +60,22 @@ Tile* Tile::get_west() {
 
 std::string Tile::get_filename() {
     std::stringstream filename;
-    filename << this->zoom << "/" << this->x << '/' << this->y << ".png";
+    filename << this->source->name << this->zoom << "/" << this->x << '/' << this->y << this->source->extension;
+    return filename.str();
+}
+
+std::string Tile::get_cache_filename() {
+    std::stringstream filename;
+    filename << this->source->name << this->zoom << "/" << this->x << '/' << this->y << ".tex";
     return filename.str();
 }
 
+std::string Tile::get_url() {
+    std::stringstream url;
+    url << this->source->url << this->zoom << "/" << this->x << '/' << this->y << this->source->extension;
+    return url.str();
+}
+
 TileFactory* TileFactory::_instance = nullptr;
 
 TileFactory::~TileFactory() {
@@ -66,12 +85,20 @@ TileFactory::~TileFactory() {
     tiles.clear();
 }
 
+double long2tilexf(double lon, int z) {
+    return (lon + 180.0) / 360.0 * pow(2.0, z);
+}
+
+double lat2tileyf(double lat, int z) {
+    return (1.0 - log( tan(lat * M_PI/180.0) + 1.0 / cos(lat * M_PI/180.0)) / M_PI) / 2.0 * pow(2.0, z);
+}
+
 int long2tilex(double lon, int z) {
-    return (int)(floor((lon + 180.0) / 360.0 * pow(2.0, z)));
+    return (int)(floor(long2tilexf(lon, z)));
 }
 
 int lat2tiley(double lat, int z) {
-    return (int)(floor((1.0 - log( tan(lat * M_PI/180.0) + 1.0 / cos(lat * M_PI/180.0)) / M_PI) / 2.0 * pow(2.0, z)));
+    return (int)(floor(lat2tileyf(lat, z)));
 }
 
 double tilex2long(int x, int z) {
@@ -94,25 +121,58 @@ double latsize(double lat, int z) {
 }
 
 Tile* TileFactory::get_tile(int zoom, double latitude, double longitude) {
+    return get_tile(&map_source, zoom, latitude, longitude);
+}
+
+Tile* TileFactory::get_tile(s_tile_source* source, int zoom, double latitude, double longitude) {
     int x = long2tilex(longitude, zoom);
     int y = lat2tiley(latitude, zoom);
-    return get_tile(zoom, x, y);
+    return get_tile(source, zoom, x, y);
 }
 
 Tile* TileFactory::get_tile(int zoom, int x, int y) {
-    std::string id = tile_id(zoom, x, y);
+    return get_tile(&map_source, zoom, x, y);
+}
+
+Tile* TileFactory::get_tile(s_tile_source* source, int zoom, int x, int y) {
+    std::string id = tile_id(source, zoom, x, y);
     std::map<std::string, Tile*>::iterator tile_iter = tiles.find(id);
     if (tile_iter != tiles.end()) {
         return tile_iter->second;
     }
-    Tile* tile = new Tile(zoom, x, y, dummy);
+    Tile* tile = new Tile(zoom, x, y, dummy, source);
     Loader::instance()->load_image(*tile);
     tiles[id] = tile;
     return tile;
 }
 
-std::string TileFactory::tile_id(int zoom, int x, int y) {
+void TileFactory::prefetch_tile(int zoom, int x, int y) {
+    std::string id = tile_id(&map_source, zoom, x, y);
+    if (tiles.find(id) != tiles.end()) {
+        return;
+    }
+    Tile* tile = new Tile(zoom, x, y, dummy);
+    Loader::instance()->prefetch_image(*tile);
+    tiles[id] = tile;
+}
+
+std::vector<Tile*> TileFactory::most_recent(size_t count) {
+    std::vector<Tile*> result;
+    for (std::pair<std::string, Tile*> tile : tiles) {
+        if (tile.second->last_used != 0 && tile.second->source == &map_source) {
+            result.push_back(tile.second);
+        }
+    }
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(), [](Tile* a, Tile* b) {
+        return a->last_used > b->last_used;
+    });
+    result.resize(count);
+    return result;
+}
+
+std::string TileFactory::tile_id(s_tile_source* source, int zoom, int x, int y) {
     std::stringstream ss;
-    ss << zoom << "/" << x << "/" << y;
+    ss << source->name << zoom << "/" << x << "/" << y;
     return ss.str();
 }
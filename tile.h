@@ -25,11 +25,54 @@
 #ifndef _SM3D_TILE_H_
 #define _SM3D_TILE_H_
 
+#include <atomic>
 #include <string>
 #include <map>
+#include <vector>
 
 #include <GL/gl.h>
 
+/**
+ * @brief a server providing tiles
+ */
+struct s_tile_source {
+    /**
+     * @brief prefix of the tiles within TILE_DIR, empty for the map tiles
+     */
+    std::string name;
+    /**
+     * @brief base URL, the tiles are found below as zoom/x/y
+     */
+    std::string url;
+    std::string extension;
+    /**
+     * @brief the highest zoom level the server provides tiles for
+     */
+    int max_zoom;
+    /**
+     * @brief whether the tiles are images used as textures of the map
+     *
+     * Otherwise the loader only fetches the file, and sets texid to 0 as soon as
+     * it is available on disk.
+     */
+    bool texture;
+};
+
+/**
+ * @brief the raster tiles of the map itself
+ */
+extern s_tile_source map_source;
+
+/**
+ * @brief elevation tiles in Terrarium encoding
+ */
+extern s_tile_source elevation_source;
+
+/**
+ * @brief Mapbox Vector Tiles, an alternative to the raster tiles of the map
+ */
+extern s_tile_source vector_source;
+
 /**
  * @brief storage class for a tile
  */
@@ -38,16 +81,31 @@ public:
     int zoom;
     int x;
     int y;
-    GLuint texid;
-    Tile(int zoom, int x, int y, GLuint texid);
+    /**
+     * @brief the texture, the dummy texture while loading and 0 once the loader
+     * threads finished the download
+     */
+    std::atomic<GLuint> texid;
+    /**
+     * @brief the time (in SDL ticks) the tile was last rendered
+     */
+    unsigned int last_used;
+    s_tile_source* source;
+    Tile(int zoom, int x, int y, GLuint texid, s_tile_source* source = &map_source);
     Tile* get(int x_diff, int y_diff);
     Tile* get_east();
     Tile* get_north();
     Tile* get_south();
     Tile* get_west();
     std::string get_filename();
+    std::string get_cache_filename();
+    std::string get_url();
 };
 
+extern double long2tilexf(double lon, int z);
+
+extern double lat2tileyf(double lat, int z);
+
 extern int long2tilex(double lon, int z);
 
 extern int lat2tiley(double lat, int z);
@@ -75,7 +133,18 @@ public:
         return _instance;
     }
     Tile* get_tile(int zoom, double latitude, double longitude);
+    Tile* get_tile(s_tile_source* source, int zoom, double latitude, double longitude);
     Tile *get_tile(int zoom, int x, int y);
+    Tile *get_tile(s_tile_source* source, int zoom, int x, int y);
+    /**
+     * @brief create a tile and decode it in the background, if it is not known yet
+     */
+    void prefetch_tile(int zoom, int x, int y);
+    /**
+     * @brief get the most recently rendered tiles
+     * @param count the maximum number of tiles
+     */
+    std::vector<Tile*> most_recent(size_t count);
     GLuint get_dummy() {
         return dummy;
     }
@@ -91,7 +160,7 @@ private:
     }
     TileFactory(const TileFactory&) {}
     ~TileFactory();
-    std::string tile_id(int zoom, int x, int y);
+    std::string tile_id(s_tile_source* source, int zoom, int x, int y);
 
     class CGuard {
     public:
@@ -0,0 +1,364 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <boost/bind/bind.hpp>
+
+#include "track.h"
+#include "loader.h"
+#include "global.h"
+
+TrackLayer* TrackLayer::_instance = nullptr;
+
+static uint64_t cell_key(int x, int y) {
+    return ((uint64_t) (uint32_t) x << 32) | (uint32_t) y;
+}
+
+/**
+ * @brief find a numeric attribute within a XML tag
+ */
+static bool attribute(const std::string& content, size_t start, size_t end, const char* name, double& value) {
+    size_t pos = start;
+    size_t length = strlen(name);
+    while ((pos = content.find(name, pos)) != std::string::npos && pos < end) {
+        // Make sure to match the whole attribute name (e.g. not "lat" within "plat")
+        if (content[pos - 1] == ' ' || content[pos - 1] == '\t' || content[pos - 1] == '\n' || content[pos - 1] == '\r') {
+            size_t quote = pos + length;
+            while (quote < end && (content[quote] == ' ' || content[quote] == '=')) {
+                quote++;
+            }
+            if (quote < end && (content[quote] == '"' || content[quote] == '\'')) {
+                char* parsed;
+                value = strtod(content.c_str() + quote + 1, &parsed);
+                return parsed != content.c_str() + quote + 1;
+            }
+        }
+        pos += length;
+    }
+    return false;
+}
+
+/**
+ * @brief distance of a point from the segment between a and b
+ */
+static double segment_distance(double px, double py, double ax, double ay, double bx, double by) {
+    double dx = bx - ax;
+    double dy = by - ay;
+    double length = dx * dx + dy * dy;
+    double t = 0.0;
+    if (length > 0.0) {
+        t = std::max(0.0, std::min(1.0, ((px - ax) * dx + (py - ay) * dy) / length));
+    }
+    double x = ax + t * dx - px;
+    double y = ay + t * dy - py;
+    return std::sqrt(x * x + y * y);
+}
+
+Track::Track(const std::string& filename) : filename(filename) {
+}
+
+Track::~Track() {
+    for (s_track_level& level : levels) {
+        if (level.vbo != 0) {
+            glDeleteBuffers(1, &level.vbo);
+        }
+    }
+}
+
+void Track::add_point(double latitude, double longitude) {
+    if (polylines.empty()) {
+        polylines.push_back(0);
+    }
+    x.push_back(long2tilexf(longitude, 0));
+    y.push_back(lat2tileyf(latitude, 0));
+}
+
+bool Track::parse_gpx(const std::string& content) {
+    size_t pos = 0;
+    while ((pos = content.find('<', pos)) != std::string::npos) {
+        if (content.compare(pos, 7, "<trkseg") == 0 || content.compare(pos, 5, "<rte>") == 0 || content.compare(pos, 5, "<rte ") == 0) {
+            // Each segment or route is a separate polyline
+            if (!polylines.empty() && polylines.back() != x.size()) {
+                polylines.push_back(x.size());
+            }
+        } else if (content.compare(pos, 6, "<trkpt") == 0 || content.compare(pos, 6, "<rtept") == 0) {
+            size_t end = content.find('>', pos);
+            double latitude, longitude;
+            if (end != std::string::npos && attribute(content, pos, end, "lat", latitude) && attribute(content, pos, end, "lon", longitude)) {
+                add_point(latitude, longitude);
+            }
+        }
+        pos++;
+    }
+    return !x.empty();
+}
+
+bool Track::parse_csv(const std::string& content) {
+    std::istringstream lines(content);
+    std::string line;
+    while (std::getline(lines, line)) {
+        // Empty lines separate polylines, lines not starting with two numbers (e.g. headers) are skipped
+        if (line.empty() || line == "\r") {
+            if (!polylines.empty() && polylines.back() != x.size()) {
+                polylines.push_back(x.size());
+            }
+            continue;
+        }
+        char* end;
+        double latitude = strtod(line.c_str(), &end);
+        if (end == line.c_str() || (*end != ',' && *end != ';')) {
+            continue;
+        }
+        char* start = end + 1;
+        double longitude = strtod(start, &end);
+        if (end == start) {
+            continue;
+        }
+        add_point(latitude, longitude);
+    }
+    return !x.empty();
+}
+
+void Track::simplify() {
+    significance.assign(x.size(), 0.0);
+
+    struct s_range {
+        size_t first;
+        size_t last;
+        double parent;
+    };
+    std::vector<s_range> stack;
+
+    for (size_t i = 0; i < polylines.size(); i++) {
+        size_t first = polylines[i];
+        size_t last = (i + 1 < polylines.size() ? polylines[i + 1] : x.size()) - 1;
+        significance[first] = std::numeric_limits<double>::infinity();
+        significance[last] = std::numeric_limits<double>::infinity();
+        stack.push_back({ first, last, std::numeric_limits<double>::infinity() });
+
+        // Run Douglas-Peucker once down to the last point and remember the tolerance at which
+        // each point is dropped. The significance of a point is capped by the one of its parent,
+        // which keeps the simplifications of all zoom levels nested.
+        while (!stack.empty()) {
+            s_range range = stack.back();
+            stack.pop_back();
+            if (range.last - range.first < 2) {
+                continue;
+            }
+            size_t index = range.first + 1;
+            double distance = -1.0;
+            for (size_t j = range.first + 1; j < range.last; j++) {
+                double d = segment_distance(x[j], y[j], x[range.first], y[range.first], x[range.last], y[range.last]);
+                if (d > distance) {
+                    distance = d;
+                    index = j;
+                }
+            }
+            distance = std::min(distance, range.parent);
+            significance[index] = distance;
+            stack.push_back({ range.first, index, distance });
+            stack.push_back({ index, range.last, distance });
+        }
+    }
+}
+
+void Track::load() {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in) {
+        std::cerr << "Failed to open track " << filename << std::endl;
+        return;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string content = buffer.str();
+
+    bool gpx = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".gpx") == 0;
+    if (!(gpx ? parse_gpx(content) : parse_csv(content))) {
+        std::cerr << "No points found in track " << filename << std::endl;
+        return;
+    }
+    std::cout << "Loaded track " << filename << " with " << x.size() << " points" << std::endl;
+
+    simplify();
+
+    // The zoom levels are independent of each other
+    for (int zoom = 1; zoom <= TRACK_MAX_ZOOM; zoom++) {
+        Loader::instance()->post(boost::bind(&Track::build, this, zoom));
+    }
+}
+
+void Track::build(int zoom) {
+    s_track_level& level = levels[zoom];
+    double scale = pow(2.0, zoom);
+    double tolerance = TRACK_TOLERANCE / (2 * TILE_SIZE * scale);
+
+    struct s_cell_vertices {
+        std::vector<GLfloat> vertices;
+        s_track_cell runs;
+    };
+    std::unordered_map<uint64_t, s_cell_vertices> cells;
+
+    for (size_t i = 0; i < polylines.size(); i++) {
+        size_t first = polylines[i];
+        size_t end = i + 1 < polylines.size() ? polylines[i + 1] : x.size();
+
+        // Segments are split at the tile borders, so every piece belongs to the tile it lies
+        // in. Consecutive pieces within the same tile form a run which is drawn as a single
+        // line strip.
+        s_cell_vertices* run = nullptr;
+        uint64_t run_key = 0;
+        int cell_x = 0;
+        int cell_y = 0;
+        size_t previous = first;
+        std::vector<double> cuts;
+        for (size_t j = first + 1; j < end; j++) {
+            if (significance[j] < tolerance) {
+                continue;
+            }
+            double px = x[previous] * scale;
+            double py = y[previous] * scale;
+            double dx = x[j] * scale - px;
+            double dy = y[j] * scale - py;
+            previous = j;
+
+            cuts.clear();
+            cuts.push_back(0.0);
+            for (double border = floor(std::min(px, px + dx)) + 1; border < std::max(px, px + dx); border++) {
+                cuts.push_back((border - px) / dx);
+            }
+            for (double border = floor(std::min(py, py + dy)) + 1; border < std::max(py, py + dy); border++) {
+                cuts.push_back((border - py) / dy);
+            }
+            cuts.push_back(1.0);
+            std::sort(cuts.begin(), cuts.end());
+
+            for (size_t k = 0; k + 1 < cuts.size(); k++) {
+                if (cuts[k + 1] <= cuts[k]) {
+                    continue;
+                }
+                // The middle of a piece is safely inside its tile, unlike its ends
+                double middle = (cuts[k] + cuts[k + 1]) / 2;
+                int cx = (int) floor(px + dx * middle);
+                int cy = (int) floor(py + dy * middle);
+                uint64_t key = cell_key(cx, cy);
+                if (run == nullptr || key != run_key) {
+                    run = &cells[key];
+                    run_key = key;
+                    cell_x = cx;
+                    cell_y = cy;
+                    run->runs.first.push_back(run->vertices.size() / 2);
+                    run->runs.count.push_back(1);
+                    run->vertices.push_back(px + dx * cuts[k] - cell_x);
+                    run->vertices.push_back(py + dy * cuts[k] - cell_y);
+                }
+                run->vertices.push_back(px + dx * cuts[k + 1] - cell_x);
+                run->vertices.push_back(py + dy * cuts[k + 1] - cell_y);
+                run->runs.count.back()++;
+            }
+        }
+    }
+
+    // Merge the tiles into a single vertex buffer
+    for (std::pair<const uint64_t, s_cell_vertices>& cell : cells) {
+        GLint offset = level.vertices.size() / 2;
+        s_track_cell& runs = level.cells[cell.first];
+        runs.count.swap(cell.second.runs.count);
+        runs.first.swap(cell.second.runs.first);
+        for (GLint& first : runs.first) {
+            first += offset;
+        }
+        level.vertices.insert(level.vertices.end(), cell.second.vertices.begin(), cell.second.vertices.end());
+        std::vector<GLfloat>().swap(cell.second.vertices);
+    }
+
+    level.ready = true;
+}
+
+TrackLayer::~TrackLayer() {
+    for (Track* track : tracks) {
+        delete track;
+    }
+    tracks.clear();
+}
+
+void TrackLayer::load(const std::string& filename) {
+    Track* track = new Track(filename);
+    tracks.push_back(track);
+    Loader::instance()->post(boost::bind(&Track::load, track));
+}
+
+void TrackLayer::draw(Tile* center, int left, int top, int right, int bottom) {
+    int zoom = std::min(center->zoom, TRACK_MAX_ZOOM);
+
+    glColor3d(0.1, 0.4, 1.0);
+    glLineWidth(3.0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    for (Track* track : tracks) {
+        s_track_level& level = track->levels[zoom];
+        if (!level.ready) {
+            continue;
+        }
+
+        // Move the finished level to the GPU once
+        if (level.vbo == 0) {
+            glGenBuffers(1, &level.vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, level.vbo);
+            glBufferData(GL_ARRAY_BUFFER, level.vertices.size() * sizeof(GLfloat), level.vertices.data(), GL_STATIC_DRAW);
+            std::vector<GLfloat>().swap(level.vertices);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, level.vbo);
+        glVertexPointer(2, GL_FLOAT, 0, nullptr);
+
+        // Segments are split at the tile borders, so only the visible tiles are needed
+        for (int y = center->y + top; y < center->y + bottom; y++) {
+            for (int x = center->x + left; x < center->x + right; x++) {
+                std::unordered_map<uint64_t, s_track_cell>::iterator cell = level.cells.find(cell_key(x, y));
+                if (cell == level.cells.end()) {
+                    continue;
+                }
+                glPushMatrix();
+                    glTranslated((x - center->x) * TILE_SIZE * 2 - TILE_SIZE, (y - center->y) * TILE_SIZE * 2 - TILE_SIZE, 0);
+                    glScaled(TILE_SIZE * 2, TILE_SIZE * 2, 1);
+                    glMultiDrawArrays(GL_LINE_STRIP, cell->second.first.data(), cell->second.count.data(), cell->second.first.size());
+                glPopMatrix();
+            }
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glLineWidth(1.0);
+    glColor3d(1.0, 1.0, 1.0);
+}
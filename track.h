@@ -0,0 +1,148 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_TRACK_H_
+#define _SM3D_TRACK_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/gl.h>
+
+#include "tile.h"
+
+/**
+ * @brief the highest zoom level tracks are prepared for
+ */
+#define TRACK_MAX_ZOOM (18)
+
+/**
+ * @brief the maximum deviation of a simplified track in pixels
+ */
+#define TRACK_TOLERANCE (0.5)
+
+/**
+ * @brief the runs of a track level within a single tile, split at its borders
+ */
+struct s_track_cell {
+    std::vector<GLint> first;
+    std::vector<GLsizei> count;
+};
+
+/**
+ * @brief a track simplified for one zoom level
+ *
+ * The vertices are stored relative to the tile they lie in (in tile units),
+ * so single precision is sufficient even at the highest zoom levels.
+ */
+struct s_track_level {
+    std::atomic<bool> ready;
+    GLuint vbo = 0;
+    std::vector<GLfloat> vertices;
+    std::unordered_map<uint64_t, s_track_cell> cells;
+    s_track_level() : ready(false) {}
+};
+
+/**
+ * @brief a GPS track loaded from a GPX or CSV file
+ */
+class Track {
+public:
+    Track(const std::string& filename);
+    ~Track();
+    std::string filename;
+    /**
+     * @brief the projected points, as tile coordinates at zoom level 0
+     */
+    std::vector<double> x;
+    std::vector<double> y;
+    /**
+     * @brief the index of the first point of each polyline
+     */
+    std::vector<size_t> polylines;
+    /**
+     * @brief the Douglas-Peucker tolerance at which a point gets dropped
+     */
+    std::vector<double> significance;
+    s_track_level levels[TRACK_MAX_ZOOM + 1];
+
+    void load();
+    void build(int zoom);
+private:
+    Track(const Track&) {}
+    bool parse_gpx(const std::string& content);
+    bool parse_csv(const std::string& content);
+    void add_point(double latitude, double longitude);
+    void simplify();
+};
+
+/**
+ * @brief draws GPS tracks on top of the map
+ */
+class TrackLayer {
+public:
+    static TrackLayer* instance() {
+        static CGuard g;
+        if (!_instance) {
+            _instance = new TrackLayer();
+        }
+        return _instance;
+    }
+
+    /**
+     * @brief load a track in the background
+     */
+    void load(const std::string& filename);
+    /**
+     * @brief draw the tracks within the visible tiles
+     * @param center the tile at the center of the screen, at the origin
+     * @param left the offset of the left most visible tile from the center tile
+     * @param top the offset of the top most visible tile from the center tile
+     * @param right the offset past the right most visible tile
+     * @param bottom the offset past the bottom most visible tile
+     */
+    void draw(Tile* center, int left, int top, int right, int bottom);
+private:
+    static TrackLayer* _instance;
+    std::vector<Track*> tracks;
+    TrackLayer() {}
+    TrackLayer(const TrackLayer&) {}
+    ~TrackLayer();
+
+    class CGuard {
+    public:
+        ~CGuard() {
+            if (TrackLayer::_instance != nullptr) {
+                delete TrackLayer::_instance;
+                TrackLayer::_instance = nullptr;
+            }
+        }
+    };
+    friend class CGuard;
+};
+
+#endif
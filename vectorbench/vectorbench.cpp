@@ -0,0 +1,141 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Benchmark of the vector tile decoding
+ *
+ * Runs decode_vector_tile() over the given tiles, read into memory up front, and
+ * reports the time per tile and the throughput. The tiles are decoded and
+ * tessellated exactly like on the loader threads, the GL upload is not part of it.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "../vectortile.h"
+
+/**
+ * @brief a tile to decode, kept in memory so the disk is not measured
+ */
+struct s_bench_tile {
+    std::string filename;
+    std::string data;
+};
+
+/**
+ * @brief add a tile, or all tiles below a directory
+ */
+static void collect(const boost::filesystem::path& path, std::vector<s_bench_tile>& tiles) {
+    if (boost::filesystem::is_directory(path)) {
+        for (boost::filesystem::recursive_directory_iterator it(path), end; it != end; ++it) {
+            if (boost::filesystem::is_regular_file(it->path()) && it->path().extension() == vector_source.extension) {
+                collect(it->path(), tiles);
+            }
+        }
+        return;
+    }
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::stringstream buffer;
+    if (!in || !(buffer << in.rdbuf())) {
+        std::cerr << "Failed to read vector tile " << path.string() << std::endl;
+        return;
+    }
+    s_bench_tile tile = { path.string(), buffer.str() };
+    tiles.push_back(tile);
+}
+
+static double percentile(const std::vector<long>& sorted, size_t percent) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 10;
+    double line_scale = 1.0;
+    std::vector<s_bench_tile> tiles;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--line-scale" && i + 1 < argc) {
+            line_scale = atof(argv[++i]);
+        } else if (arg.compare(0, 2, "--") != 0) {
+            collect(arg, tiles);
+        } else {
+            tiles.clear();
+            break;
+        }
+    }
+    if (tiles.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--iterations <n>] [--line-scale <factor>] <tile.pbf|directory>..." << std::endl;
+        return 1;
+    }
+
+    // The first pass warms the caches and finds the tiles the viewer would reject
+    unsigned long long bytes = 0;
+    unsigned long long vertices = 0;
+    size_t malformed = 0;
+    for (s_bench_tile& tile : tiles) {
+        s_vector_mesh mesh;
+        if (!decode_vector_tile(tile.data, mesh, line_scale)) {
+            std::cerr << "Failed to decode vector tile " << tile.filename << std::endl;
+            malformed++;
+        }
+        bytes += tile.data.size();
+        vertices += mesh.count;
+    }
+
+    std::vector<long> latencies;
+    latencies.reserve(tiles.size() * iterations);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        for (s_bench_tile& tile : tiles) {
+            std::chrono::steady_clock::time_point tile_start = std::chrono::steady_clock::now();
+            s_vector_mesh mesh;
+            decode_vector_tile(tile.data, mesh, line_scale);
+            latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tile_start).count());
+        }
+    }
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000000.0;
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << "Vector tiles: " << tiles.size() << " tiles (" << malformed << " malformed), "
+              << (bytes / 1024.0 / tiles.size()) << " kB and " << (vertices / tiles.size()) << " vertices per tile, "
+              << iterations << " iterations" << std::endl;
+    std::cout << "Vector tiles: " << (latencies.size() / std::max(seconds, 0.000001)) << " tiles/s, "
+              << (bytes * iterations / 1048576.0 / std::max(seconds, 0.000001)) << " MB/s, per tile p50 "
+              << percentile(latencies, 50) << " ms p99 " << percentile(latencies, 99) << " ms max "
+              << percentile(latencies, 100) << " ms" << std::endl;
+    return 0;
+}
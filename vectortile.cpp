@@ -0,0 +1,562 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/bind/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "vectortile.h"
+#include "tessellate.h"
+#include "loader.h"
+#include "global.h"
+
+struct s_vector_config vector_config;
+
+VectorTiles* VectorTiles::_instance = nullptr;
+
+/**
+ * @brief how features of a layer are drawn
+ */
+struct s_vector_style {
+    const char* layer;
+    /**
+     * @brief the value of the "class" tag, nullptr to match any feature
+     */
+    const char* type;
+    GLubyte color[3];
+    /**
+     * @brief the width of lines in pixels, 0 to fill polygons
+     */
+    float width;
+};
+
+/**
+ * @brief the style table (following the OpenMapTiles schema), in drawing order
+ */
+static const s_vector_style styles[] = {
+    { "landcover", "grass", { 205, 235, 176 }, 0.0 },
+    { "landcover", "wood", { 173, 209, 158 }, 0.0 },
+    { "landuse", "residential", { 224, 223, 223 }, 0.0 },
+    { "landuse", nullptr, { 230, 228, 224 }, 0.0 },
+    { "park", nullptr, { 200, 250, 204 }, 0.0 },
+    { "water", nullptr, { 170, 211, 223 }, 0.0 },
+    { "waterway", nullptr, { 170, 211, 223 }, 1.5 },
+    { "building", nullptr, { 217, 208, 201 }, 0.0 },
+    { "boundary", nullptr, { 172, 70, 172 }, 1.0 },
+    { "transportation", "motorway", { 232, 146, 162 }, 4.0 },
+    { "transportation", "trunk", { 249, 178, 156 }, 3.5 },
+    { "transportation", "primary", { 252, 214, 164 }, 3.0 },
+    { "transportation", "secondary", { 247, 250, 191 }, 2.5 },
+    { "transportation", "rail", { 153, 153, 153 }, 1.0 },
+    { "transportation", nullptr, { 255, 255, 255 }, 1.5 },
+};
+
+static const size_t style_count = sizeof(styles) / sizeof(styles[0]);
+
+static const GLubyte background[3] = { 242, 239, 233 };
+
+enum {
+    GEOMETRY_POINT = 1,
+    GEOMETRY_LINESTRING = 2,
+    GEOMETRY_POLYGON = 3
+};
+
+namespace {
+
+/**
+ * @brief minimal reader for the protobuf wire format
+ */
+class Pbf {
+public:
+    Pbf(const char* data, size_t size) : data((const uint8_t*) data), end((const uint8_t*) data + size) {}
+
+    /**
+     * @brief advance to the next field
+     * @return false at the end of the message (or if it is malformed)
+     */
+    bool next() {
+        if (data >= end) {
+            return false;
+        }
+        uint64_t key = varint();
+        tag = key >> 3;
+        type = key & 0x7;
+        return data <= end;
+    }
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; data < end && shift < 64; shift += 7) {
+            uint8_t byte = *data++;
+            value |= (uint64_t) (byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        data = end + 1;
+        return 0;
+    }
+    Pbf message() {
+        uint64_t size = varint();
+        if (data > end || size > (uint64_t) (end - data)) {
+            data = end + 1;
+            return Pbf(nullptr, 0);
+        }
+        Pbf result((const char*) data, size);
+        data += size;
+        return result;
+    }
+    std::string string() {
+        Pbf value = message();
+        return std::string((const char*) value.data, value.end - value.data);
+    }
+    std::vector<uint32_t> packed() {
+        Pbf values = message();
+        std::vector<uint32_t> result;
+        while (values.data < values.end) {
+            result.push_back(values.varint());
+        }
+        if (values.failed()) {
+            data = end + 1;
+        }
+        return result;
+    }
+    /**
+     * @brief whether the message turned out to be malformed
+     */
+    bool failed() const {
+        return data > end;
+    }
+    void skip() {
+        if (type == 0) {
+            varint();
+        } else if (type == 1) {
+            data += 8;
+        } else if (type == 2) {
+            message();
+        } else if (type == 5) {
+            data += 4;
+        } else {
+            data = end + 1;
+        }
+    }
+    uint32_t tag = 0;
+    uint32_t type = 0;
+private:
+    const uint8_t* data;
+    const uint8_t* end;
+};
+
+int32_t zigzag(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+const s_vector_style* find_style(const std::string& layer, const std::string& type, size_t& index) {
+    for (index = 0; index < style_count; index++) {
+        if (layer == styles[index].layer && (styles[index].type == nullptr || type == styles[index].type)) {
+            return &styles[index];
+        }
+    }
+    return nullptr;
+}
+
+void add_vertex(std::vector<s_vector_vertex>& vertices, double x, double y, const GLubyte* color) {
+    s_vector_vertex vertex = { (GLfloat) x, (GLfloat) y, { color[0], color[1], color[2], 255 } };
+    vertices.push_back(vertex);
+}
+
+void add_polygon(std::vector<s_vector_vertex>& vertices, const std::vector<ring_t>& rings, const GLubyte* color) {
+    std::vector<unsigned int> triangles;
+    tessellate(rings, triangles);
+    std::vector<const double*> points;
+    for (const ring_t& ring : rings) {
+        for (size_t i = 0; i < ring.size(); i += 2) {
+            points.push_back(&ring[i]);
+        }
+    }
+    for (unsigned int index : triangles) {
+        add_vertex(vertices, points[index][0], points[index][1], color);
+    }
+}
+
+void add_line(std::vector<s_vector_vertex>& vertices, const ring_t& line, float width, const GLubyte* color) {
+    for (size_t i = 2; i < line.size(); i += 2) {
+        double ax = line[i - 2];
+        double ay = line[i - 1];
+        double bx = line[i];
+        double by = line[i + 1];
+        double length = std::sqrt((bx - ax) * (bx - ax) + (by - ay) * (by - ay));
+        if (length == 0.0) {
+            continue;
+        }
+        // Extrude each segment into a quad
+        double nx = -(by - ay) / length * width / 2;
+        double ny = (bx - ax) / length * width / 2;
+        add_vertex(vertices, ax + nx, ay + ny, color);
+        add_vertex(vertices, bx + nx, by + ny, color);
+        add_vertex(vertices, ax - nx, ay - ny, color);
+        add_vertex(vertices, bx + nx, by + ny, color);
+        add_vertex(vertices, bx - nx, by - ny, color);
+        add_vertex(vertices, ax - nx, ay - ny, color);
+    }
+}
+
+/**
+ * @brief decode the commands of a geometry into lines or rings, in pixels relative to the tile center
+ */
+std::vector<ring_t> decode_geometry(const std::vector<uint32_t>& geometry, double scale) {
+    std::vector<ring_t> parts;
+    int32_t x = 0;
+    int32_t y = 0;
+    size_t i = 0;
+    while (i < geometry.size()) {
+        uint32_t command = geometry[i] & 0x7;
+        uint32_t count = geometry[i] >> 3;
+        i++;
+        if (command == 1 || command == 2) {
+            for (uint32_t j = 0; j < count && i + 1 < geometry.size(); j++) {
+                x += zigzag(geometry[i++]);
+                y += zigzag(geometry[i++]);
+                if (command == 1) {
+                    parts.push_back(ring_t());
+                }
+                if (!parts.empty()) {
+                    parts.back().push_back(x * scale - TILE_SIZE);
+                    parts.back().push_back(y * scale - TILE_SIZE);
+                }
+            }
+        } else if (command != 7) {
+            break;
+        }
+    }
+    return parts;
+}
+
+double ring_area(const ring_t& ring) {
+    double sum = 0.0;
+    for (size_t i = 0, j = ring.size() - 2; i < ring.size(); i += 2) {
+        sum += ring[j] * ring[i + 1] - ring[i] * ring[j + 1];
+        j = i;
+    }
+    return sum / 2;
+}
+
+}
+
+bool decode_vector_tile(const std::string& data, s_vector_mesh& mesh, double line_scale) {
+    bool valid = !data.empty();
+
+    // Collect the triangles per style first, the style table defines the drawing order
+    std::vector<std::vector<s_vector_vertex> > batches(style_count);
+
+    Pbf tile(data.data(), data.size());
+    while (tile.next()) {
+        if (tile.tag != 3 || tile.type != 2) {
+            tile.skip();
+            continue;
+        }
+
+        Pbf layer = tile.message();
+        std::string name;
+        std::vector<std::string> keys;
+        std::vector<std::string> values;
+        std::vector<Pbf> features;
+        uint32_t extent = 4096;
+        while (layer.next()) {
+            if (layer.tag == 1 && layer.type == 2) {
+                name = layer.string();
+            } else if (layer.tag == 2 && layer.type == 2) {
+                features.push_back(layer.message());
+            } else if (layer.tag == 3 && layer.type == 2) {
+                keys.push_back(layer.string());
+            } else if (layer.tag == 4 && layer.type == 2) {
+                // Only string values are of interest for the style
+                Pbf value = layer.message();
+                std::string text;
+                while (value.next()) {
+                    if (value.tag == 1 && value.type == 2) {
+                        text = value.string();
+                    } else {
+                        value.skip();
+                    }
+                }
+                values.push_back(text);
+            } else if (layer.tag == 5 && layer.type == 0) {
+                extent = layer.varint();
+            } else {
+                layer.skip();
+            }
+        }
+        if (layer.failed()) {
+            valid = false;
+        }
+        if (extent == 0) {
+            continue;
+        }
+        double scale = 2 * TILE_SIZE / extent;
+
+        for (Pbf& feature : features) {
+            uint32_t type = 0;
+            std::vector<uint32_t> tags;
+            std::vector<uint32_t> geometry;
+            while (feature.next()) {
+                if (feature.tag == 2 && feature.type == 2) {
+                    tags = feature.packed();
+                } else if (feature.tag == 3 && feature.type == 0) {
+                    type = feature.varint();
+                } else if (feature.tag == 4 && feature.type == 2) {
+                    geometry = feature.packed();
+                } else {
+                    feature.skip();
+                }
+            }
+            if (feature.failed()) {
+                valid = false;
+                continue;
+            }
+
+            std::string feature_class;
+            for (size_t i = 0; i + 1 < tags.size(); i += 2) {
+                if (tags[i] < keys.size() && tags[i + 1] < values.size() && keys[tags[i]] == "class") {
+                    feature_class = values[tags[i + 1]];
+                }
+            }
+            size_t index;
+            const s_vector_style* style = find_style(name, feature_class, index);
+            if (style == nullptr || type == GEOMETRY_POINT) {
+                continue;
+            }
+
+            std::vector<ring_t> parts = decode_geometry(geometry, scale);
+            if (style->width > 0.0) {
+                for (ring_t& part : parts) {
+                    // Close the outlines of polygons
+                    if (type == GEOMETRY_POLYGON && part.size() >= 2) {
+                        part.push_back(part[0]);
+                        part.push_back(part[1]);
+                    }
+                    add_line(batches[index], part, style->width * line_scale, style->color);
+                }
+            } else if (type == GEOMETRY_POLYGON) {
+                // Rings with a positive area start a new polygon, the others are its holes
+                std::vector<ring_t> polygon;
+                for (ring_t& part : parts) {
+                    if (part.size() < 6) {
+                        continue;
+                    }
+                    double area = ring_area(part);
+                    if (area > 0 && !polygon.empty()) {
+                        add_polygon(batches[index], polygon, style->color);
+                        polygon.clear();
+                    }
+                    if (area > 0 || !polygon.empty()) {
+                        polygon.push_back(part);
+                    }
+                }
+                if (!polygon.empty()) {
+                    add_polygon(batches[index], polygon, style->color);
+                }
+            }
+        }
+    }
+    if (tile.failed()) {
+        valid = false;
+    }
+
+    // The background covers the whole tile, also below the parts of a broken tile
+    add_vertex(mesh.vertices, -TILE_SIZE, -TILE_SIZE, background);
+    add_vertex(mesh.vertices, TILE_SIZE, -TILE_SIZE, background);
+    add_vertex(mesh.vertices, TILE_SIZE, TILE_SIZE, background);
+    add_vertex(mesh.vertices, -TILE_SIZE, -TILE_SIZE, background);
+    add_vertex(mesh.vertices, TILE_SIZE, TILE_SIZE, background);
+    add_vertex(mesh.vertices, -TILE_SIZE, TILE_SIZE, background);
+    for (std::vector<s_vector_vertex>& batch : batches) {
+        mesh.vertices.insert(mesh.vertices.end(), batch.begin(), batch.end());
+    }
+    mesh.count = mesh.vertices.size();
+
+    return valid;
+}
+
+static uint64_t tile_key(int zoom, int x, int y) {
+    return ((uint64_t) zoom << 56) | ((uint64_t) x << 28) | (uint64_t) y;
+}
+
+VectorTiles::~VectorTiles() {
+    // The loader is destroyed first, meshes it did not build any more are left alone
+    for (std::pair<const uint64_t, s_vector_mesh*>& mesh : meshes) {
+        if (mesh.second->ready) {
+            delete mesh.second;
+        }
+    }
+    meshes.clear();
+}
+
+void VectorTiles::build(Tile* tile, int shift, s_vector_mesh* mesh) {
+    std::string filename = TILE_DIR + tile->get_filename();
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    std::stringstream buffer;
+    if (!in || !(buffer << in.rdbuf())) {
+        std::cerr << "Failed to read vector tile " << filename << std::endl;
+        mesh->missing = !boost::filesystem::exists(filename);
+        mesh->ready = true;
+        return;
+    }
+    std::string data = buffer.str();
+
+    // Tiles drawn enlarged get thinner lines, so they keep their width on screen
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!decode_vector_tile(data, *mesh, 1.0 / (1 << shift))) {
+        std::cerr << "Failed to decode vector tile " << filename << std::endl;
+    }
+    long micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    mesh->ready = true;
+
+    // Report the decode and tessellation throughput from time to time
+    build_micros += micros;
+    build_bytes += data.size();
+    unsigned long count = ++built;
+    if (count % VECTOR_STATISTICS_INTERVAL == 0) {
+        std::cout << "Vector tiles: " << count << " decoded and tessellated, " << (build_micros / 1000.0 / count) << " ms and "
+                  << (build_bytes / 1024.0 / count) << " kB per tile" << std::endl;
+    }
+}
+
+void VectorTiles::evict() {
+    if (meshes.size() <= VECTOR_CACHE) {
+        return;
+    }
+    std::unordered_map<uint64_t, s_vector_mesh*>::iterator oldest = meshes.end();
+    for (std::unordered_map<uint64_t, s_vector_mesh*>::iterator it = meshes.begin(); it != meshes.end(); ++it) {
+        if (it->second->ready && (oldest == meshes.end() || it->second->last_used < oldest->second->last_used)) {
+            oldest = it;
+        }
+    }
+    if (oldest == meshes.end()) {
+        return;
+    }
+    if (oldest->second->vbo != 0) {
+        glDeleteBuffers(1, &oldest->second->vbo);
+    }
+    delete oldest->second;
+    meshes.erase(oldest);
+}
+
+bool VectorTiles::draw_tile(Tile* tile) {
+    // Beyond the highest zoom level use the covering tile of the highest zoom level
+    int shift = std::max(0, tile->zoom - tile->source->max_zoom);
+    Tile* source_tile = tile;
+    if (shift > 0) {
+        source_tile = TileFactory::instance()->get_tile(tile->source, tile->source->max_zoom, tile->x >> shift, tile->y >> shift);
+    }
+
+    // Each enlargement has its own mesh, as the line widths depend on it
+    uint64_t key = tile_key(source_tile->zoom, source_tile->x, source_tile->y) | ((uint64_t) shift << 61);
+    std::unordered_map<uint64_t, s_vector_mesh*>::iterator found = meshes.find(key);
+    if (found == meshes.end()) {
+        if (source_tile->texid != 0) {
+            return false;
+        }
+        s_vector_mesh* mesh = new s_vector_mesh();
+        meshes[key] = mesh;
+        Loader::instance()->post(boost::bind(&VectorTiles::build, this, source_tile, shift, mesh));
+        evict();
+        return false;
+    }
+
+    s_vector_mesh* mesh = found->second;
+
+    // The tile was evicted meanwhile, fetch it again and build the mesh once it is back
+    if (mesh->ready && mesh->missing) {
+        if (source_tile->texid == 0) {
+            source_tile->texid = TileFactory::instance()->get_dummy();
+            Loader::instance()->load_image(*source_tile);
+        }
+        delete mesh;
+        meshes.erase(found);
+        return false;
+    }
+
+    if (!mesh->ready || mesh->count == 0) {
+        return false;
+    }
+    mesh->last_used = tile->last_used;
+
+    // Move the finished mesh to the GPU once
+    if (mesh->vbo == 0) {
+        glGenBuffers(1, &mesh->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+        glBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(s_vector_vertex), mesh->vertices.data(), GL_STATIC_DRAW);
+        std::vector<s_vector_vertex>().swap(mesh->vertices);
+    }
+
+    glPushMatrix();
+        if (shift > 0) {
+            int tiles = 1 << shift;
+            int column = tile->x - (source_tile->x << shift);
+            int row = tile->y - (source_tile->y << shift);
+            glTranslated(((tiles - 1) / 2.0 - column) * TILE_SIZE * 2, ((tiles - 1) / 2.0 - row) * TILE_SIZE * 2, 0);
+            glScaled(tiles, tiles, 1.0);
+
+            // Clip the covering tile to the area of this tile. The modelview matrix is not used by
+            // the renderer, so the planes are given in the coordinates of the mesh.
+            double size = TILE_SIZE * 2 / tiles;
+            double left = -TILE_SIZE + column * size;
+            double top = -TILE_SIZE + row * size;
+            const GLdouble planes[4][4] = {
+                { 1.0, 0.0, 0.0, -left },
+                { -1.0, 0.0, 0.0, left + size },
+                { 0.0, 1.0, 0.0, -top },
+                { 0.0, -1.0, 0.0, top + size }
+            };
+            for (int i = 0; i < 4; i++) {
+                glClipPlane(GL_CLIP_PLANE0 + i, planes[i]);
+                glEnable(GL_CLIP_PLANE0 + i);
+            }
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(2, GL_FLOAT, sizeof(s_vector_vertex), nullptr);
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(s_vector_vertex), (const GLvoid*) (2 * sizeof(GLfloat)));
+        glDrawArrays(GL_TRIANGLES, 0, mesh->count);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        for (int i = 0; i < 4; i++) {
+            glDisable(GL_CLIP_PLANE0 + i);
+        }
+    glPopMatrix();
+
+    return true;
+}
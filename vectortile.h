@@ -0,0 +1,146 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Christoph Brill
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SM3D_VECTORTILE_H_
+#define _SM3D_VECTORTILE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/gl.h>
+
+#include "tile.h"
+
+/**
+ * @brief the number of vector tile meshes kept in memory
+ */
+#define VECTOR_CACHE (512)
+
+/**
+ * @brief print the decoding statistics after this many tiles
+ */
+#define VECTOR_STATISTICS_INTERVAL (50)
+
+/**
+ * @brief holds the configuration of the vector tiles
+ */
+struct s_vector_config {
+    /**
+     * @brief draw vector tiles instead of the raster tiles
+     */
+    bool enabled = false;
+};
+
+extern struct s_vector_config vector_config;
+
+struct s_vector_vertex {
+    GLfloat x;
+    GLfloat y;
+    GLubyte color[4];
+};
+
+/**
+ * @brief the triangles of a single vector tile, in drawing order
+ */
+struct s_vector_mesh {
+    std::atomic<bool> ready;
+    /**
+     * @brief the tile was evicted before the mesh was built, it is downloaded again
+     */
+    bool missing = false;
+    GLuint vbo = 0;
+    GLsizei count = 0;
+    std::vector<s_vector_vertex> vertices;
+    unsigned int last_used = 0;
+    s_vector_mesh() : ready(false) {}
+};
+
+/**
+ * @brief decode a Mapbox Vector Tile and tessellate it with the style table
+ * @param data the protobuf encoded (uncompressed) tile
+ * @param mesh receives the triangles, centered at the origin like a map tile
+ * @param line_scale factor applied to the line widths of the style table
+ * @return false, if the tile is empty or malformed, the mesh then holds the parts which could be decoded
+ */
+extern bool decode_vector_tile(const std::string& data, s_vector_mesh& mesh, double line_scale = 1.0);
+
+/**
+ * @brief draws vector tiles in place of the raster tiles
+ *
+ * The tiles are fetched through the TileFactory and the Loader like the raster
+ * tiles. Decoding and tessellation happens on the loader threads, the render
+ * thread only uploads the finished meshes into vertex buffers.
+ */
+class VectorTiles {
+public:
+    static VectorTiles* instance() {
+        static CGuard g;
+        if (!_instance) {
+            _instance = new VectorTiles();
+        }
+        return _instance;
+    }
+
+    /**
+     * @brief draw a vector tile centered at the origin
+     *
+     * Beyond the highest zoom level of the source, the matching part of the
+     * tile of the highest zoom level is drawn.
+     * @return false, if the tile is not available (yet)
+     */
+    bool draw_tile(Tile* tile);
+private:
+    static VectorTiles* _instance;
+    std::unordered_map<uint64_t, s_vector_mesh*> meshes;
+
+    std::atomic<unsigned long> built;
+    std::atomic<unsigned long> build_micros;
+    std::atomic<unsigned long> build_bytes;
+
+    VectorTiles() : built(0), build_micros(0), build_bytes(0) {}
+    VectorTiles(const VectorTiles&) {}
+    ~VectorTiles();
+
+    /**
+     * @brief decode and tessellate a tile which is drawn enlarged by 2^shift
+     */
+    void build(Tile* tile, int shift, s_vector_mesh* mesh);
+    void evict();
+
+    class CGuard {
+    public:
+        ~CGuard() {
+            if (VectorTiles::_instance != nullptr) {
+                delete VectorTiles::_instance;
+                VectorTiles::_instance = nullptr;
+            }
+        }
+    };
+    friend class CGuard;
+};
+
+#endif